@@ -1,10 +1,10 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include "bitlib.h"
 
 #define __user
 #define min(a,b) ((a)<(b)?(a):(b))
-#define BITS_PER_LONG (8 * 4)
 #define BITOP_WORD(nr)		((nr) / BITS_PER_LONG)
 #define BITOP_LE_SWIZZLE	((BITS_PER_LONG-1) & ~0x7)
 #define BITMAP_LAST_WORD_MASK(nbits)					\
@@ -35,9 +35,14 @@ unsigned int hweight32(unsigned int w)
 	return (res + (res >> 16)) & 0x000000FF;
 }
 
+unsigned int hweight64(uint64_t w)
+{
+    return hweight32(w) + hweight32(w >> 32);
+}
+
 unsigned int hweight_long(unsigned long w)
 {
-    return hweight32(w);
+    return sizeof(w) == 4 ? hweight32(w) : hweight64(w);
 }
 
 /**
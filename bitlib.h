@@ -1,5 +1,13 @@
 #include <stdint.h>
 
+#define BITS_PER_LONG ((int) (8 * sizeof(long)))
+
+unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+			    unsigned long offset);
+unsigned long find_next_zero_bit(const unsigned long *addr,
+				 unsigned long size, unsigned long offset);
+void bitmap_set(unsigned long *map, int start, int nr);
+void bitmap_clear(unsigned long *map, int start, int nr);
 unsigned long bitmap_find_next_zero_area(unsigned long *map,
 					 unsigned long size,
 					 unsigned long start,
@@ -29,6 +37,17 @@ static inline int ilog2(int f)
     return fls(f) - 1;
 }
 
+/* the same for 64-bit values, which are too many bits to shift out */
+static inline int fls64(uint64_t f)
+{
+    return f ? 64 - __builtin_clzll(f) : 0;
+}
+
+static inline int ilog2_64(uint64_t f)
+{
+    return fls64(f) - 1;
+}
+
 static inline int is_power_of_two(int f)
 {
     return (f & (f-1)) == 0;
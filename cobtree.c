@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <time.h>
 #include <assert.h>
+#include <limits.h>
+#include <unistd.h>
 #include "types.h"
 #include "pma.h"
 #include "vebtree.h"
+#include "shard.h"
 
 /*
  *  This implements the "Locality preserving dynamic dictionary" of
@@ -13,19 +17,26 @@
  *  binary tree for indexing a resizable array.
  */
 
-void permute_array(key_t *array, int count)
+/*
+ *  The i-th key a run inserts, 1 to 999, from a hash of i, so that a
+ *  run of any length needs no array of them and the searches can
+ *  generate the same keys again.
+ */
+static key_t key_at(u64 i)
 {
-    int i, j;
-    key_t tmp;
+    i = (i ^ (i >> 33)) * 0xff51afd7ed558ccdULL;
+    i = (i ^ (i >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return 1 + (i ^ (i >> 33)) % 999;
+}
 
-    srand(100);
-    for (i=0; i < count; i++)
-    {
-        j = i + (random() % (count - i));
-        tmp = array[i];
-        array[i] = array[j];
-        array[j] = tmp;
-    }
+/*
+ *  The keys are searched for in a scrambled order: an odd multiplier
+ *  permutes the indices modulo a power of two, and nkeys is always
+ *  a power of two.
+ */
+static inline u64 search_index(u64 i, u64 nkeys)
+{
+    return (i * 0x9e3779b97f4a7c15ULL) & (nkeys - 1);
 }
 
 void timespec_sub(struct timespec *a, struct timespec *b, struct timespec *res)
@@ -39,34 +50,67 @@ void timespec_sub(struct timespec *a, struct timespec *b, struct timespec *res)
     }
 }
 
-/* runs the profile loop and returns total # of us */
-u64 runprof(struct pma *pma, int *keys, int nkeys, int ntrials)
+/*
+ *  runs the profile loop and returns total # of us.  Keys that are
+ *  not found, or found as some other key, are counted in *misses.
+ */
+u64 runprof(struct pma *pma, u64 nkeys, u64 ntrials, u64 *misses)
 {
-    int i;
+    u64 i;
     struct timespec start_time;
     struct timespec end_time;
     struct timespec diff_time;
 
     fprintf(stderr, ".\n");
+    *misses = 0;
 
     clock_gettime(CLOCK_MONOTONIC, &start_time);
     for (i=0; i < ntrials; i++)
     {
         struct leaf *leaf;
 
-        int which = i % nkeys;
-        leaf = pma_search(pma, keys[which]);
-        if (leaf != NULL && leaf->key != keys[which])
-        {
-            printf("Could not recover %d (got %d)\n", keys[which],
-                leaf->key);
-        }
+        key_t key = key_at(search_index(i, nkeys));
+        leaf = pma_search(pma, key);
+        if (leaf == NULL || leaf->key != key)
+            (*misses)++;
     }
     clock_gettime(CLOCK_MONOTONIC, &end_time);
     timespec_sub(&end_time, &start_time, &diff_time);
     return diff_time.tv_sec * 1000000 + (diff_time.tv_nsec / 1000);
 }
 
+struct range_check {
+    key_t last;
+    u64 count;
+    u64 unordered;
+};
+
+static void check_key(key_t key, void *arg)
+{
+    struct range_check *rc = arg;
+
+    if (rc->count && key < rc->last)
+        rc->unordered++;
+    rc->last = key;
+    rc->count++;
+}
+
+/*
+ *  A range scan over everything must return all nitems keys, in
+ *  order.  Returns true if it did, else reports what went wrong.
+ */
+bool check_range(struct range_check *rc, u64 nitems)
+{
+    if (!rc->unordered && rc->count == nitems)
+        return true;
+
+    fprintf(stderr,
+            "range scan returned %llu of %llu keys, %llu out of order\n",
+            (unsigned long long) rc->count, (unsigned long long) nitems,
+            (unsigned long long) rc->unordered);
+    return false;
+}
+
 void *empty_cache()
 {
     /* try to kill the cache */
@@ -78,43 +122,233 @@ void *empty_cache()
     return buf2;
 }
 
-#define MAX_KEYS (1 << 30)
+/*
+ *  The PMA sizes its array in an int, and growing an array of more
+ *  than 2^30 slots would overflow it.  2^28 keys fit in 2^29 slots.
+ */
+#define MAX_KEYS (1ULL << 28)
 #define NTRIALS 100000
-int main(int argc, char *argv[])
+
+/*
+ *  Same workload through the sharded router: inserts are handed to
+ *  the shard workers, so the insert time is mostly routing until the
+ *  final searches wait for the queues to drain.
+ */
+int run_sharded(int nshards)
 {
-    int i;
-    int nkeys;
+    u64 i;
+    u64 nkeys;
+    struct router *r;
+    struct leaf leaf;
+    struct range_check rc;
+    struct timespec start_time, end_time, diff_time;
+    u64 insert_time, search_time;
+    int failed = 0;
+
+    for (nkeys=(1<<8); nkeys <= MAX_KEYS; nkeys <<= 1)
+    {
+        r = router_new(nshards, 4 * nshards, nkeys / nshards, 1, 1000);
+
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (i=0; i < nkeys; i++)
+            router_insert(r, key_at(i));
+
+        /* a search in every shard waits for the inserts to land */
+        for (i=0; i < (u64) r->nshards; i++)
+            router_search(r, r->separators[i], &leaf);
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        timespec_sub(&end_time, &start_time, &diff_time);
+        insert_time = diff_time.tv_sec * 1000000 + diff_time.tv_nsec / 1000;
+
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (i=0; i < NTRIALS; i++)
+            router_search(r, key_at(search_index(i, nkeys)), &leaf);
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        timespec_sub(&end_time, &start_time, &diff_time);
+        search_time = diff_time.tv_sec * 1000000 + diff_time.tv_nsec / 1000;
+
+        memset(&rc, 0, sizeof(rc));
+        router_range(r, 1, 1000, check_key, &rc);
+        if (!check_range(&rc, nkeys))
+            failed = 1;
+
+        printf("%llu %g %g %d\n", (unsigned long long) nkeys,
+               search_time / 1000000., insert_time / 1000000., r->nshards);
+
+        fflush(stdout);
+        router_free(r);
+    }
+    return failed;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *) a;
+    u64 y = *(const u64 *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Time each insert on its own, starting from a small array so that
+ *  every doubling is included, and report the latency tail in us.
+ *  The last column is the slowest insert that started or finished a
+ *  grow, which the tail alone can hide among big rebalances.
+ */
+void run_latency(bool compressed)
+{
+    u64 i;
+    u64 nkeys;
     struct pma *pma;
-    key_t *values;
+    u64 *lat;
+    u64 grow_max;
+    bool growing;
+    struct timespec start_time, end_time, diff_time;
 
     srandom(10);
     for (nkeys=(1<<8); nkeys <= MAX_KEYS; nkeys <<= 1)
     {
-        pma = pma_new(nkeys);
-        values = malloc(nkeys * sizeof(key_t));
+        pma = compressed ? pma_new_compressed(1 << 8) : pma_new(1 << 8);
+        lat = malloc(nkeys * sizeof(*lat));
+        grow_max = 0;
 
         for (i=0; i < nkeys; i++)
         {
-            values[i] = random() % 1000;
-            if (values[i] == 0) {
-                i--;
-                continue;
-            }
-            pma_insert(pma, values[i]);
+            growing = pma->migration != NULL;
+            clock_gettime(CLOCK_MONOTONIC, &start_time);
+            pma_insert(pma, 1 + random() % 1000000000);
+            clock_gettime(CLOCK_MONOTONIC, &end_time);
+            timespec_sub(&end_time, &start_time, &diff_time);
+            lat[i] = diff_time.tv_sec * 1000000000ULL + diff_time.tv_nsec;
+
+            if (growing != (pma->migration != NULL))
+                grow_max = max(grow_max, lat[i]);
+        }
+
+        qsort(lat, nkeys, sizeof(*lat), cmp_u64);
+        printf("%llu %g %g %g %g %g\n", (unsigned long long) nkeys,
+               lat[nkeys / 2] / 1000.,
+               lat[nkeys * 99 / 100] / 1000.,
+               lat[nkeys * 999 / 1000] / 1000.,
+               lat[nkeys - 1] / 1000.,
+               grow_max / 1000.);
+
+        fflush(stdout);
+        free(lat);
+        pma_free(pma);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    u64 i;
+    u64 nkeys;
+    struct pma *pma;
+    int opt;
+    u64 misses;
+    int failed = 0;
+    struct range_check rc;
+    bool compressed = false;
+    bool values_out_of_line = false;
+    bool deferred = false;
+    bool latency = false;
+    char value[256];
+    int nshards = 0;
+
+    while ((opt = getopt(argc, argv, "cdlvS:")) != -1)
+    {
+        switch(opt) {
+        case 'S':
+            nshards = atoi(optarg);
+            break;
+        case 'c':
+            compressed = true;
+            break;
+        case 'd':
+            deferred = true;
+            break;
+        case 'l':
+            latency = true;
+            break;
+        case 'v':
+            values_out_of_line = true;
+            break;
+        default:
+            fprintf(stderr, "unknown param\n");
+            exit(-1);
+        }
+    }
+
+    memset(value, 'x', sizeof(value));
+
+    if (nshards)
+        return run_sharded(nshards);
+
+    if (latency)
+    {
+        run_latency(compressed);
+        return 0;
+    }
+
+    for (nkeys=(1<<8); nkeys <= MAX_KEYS; nkeys <<= 1)
+    {
+        if (values_out_of_line)
+            pma = pma_new_vlog(nkeys, NULL);
+        else if (compressed)
+            pma = pma_new_compressed(nkeys);
+        else
+            pma = pma_new(nkeys);
+        if (deferred)
+            pma_start_deferred(pma);
+
+        for (i=0; i < nkeys; i++)
+        {
+            if (values_out_of_line)
+                pma_insert_value(pma, key_at(i), value,
+                                 sizeof(value) - (i % 128));
+            else
+                pma_insert(pma, key_at(i));
             /* pma_print(pma); */
         }
 
-        fprintf(stderr, "%d keys\n", nkeys);
+        /* every key must be found while some are still in the backlog */
+        if (deferred)
+        {
+            runprof(pma, nkeys, nkeys, &misses);
+            if (misses)
+            {
+                fprintf(stderr,
+                        "%llu of %llu searches missed before the flush\n",
+                        (unsigned long long) misses,
+                        (unsigned long long) nkeys);
+                failed = 1;
+            }
+        }
+
+        /* time searches against the settled array */
+        pma_flush(pma);
+        fprintf(stderr, "%llu keys\n", (unsigned long long) nkeys);
 
-        permute_array(values, nkeys);
+        u64 search_time = runprof(pma, nkeys, NTRIALS, &misses);
+        if (misses)
+        {
+            fprintf(stderr, "%llu of %d searches missed\n",
+                    (unsigned long long) misses, NTRIALS);
+            failed = 1;
+        }
 
-        u64 search_time = runprof(pma, values, nkeys, NTRIALS);
+        memset(&rc, 0, sizeof(rc));
+        pma_range(pma, INT_MIN, INT_MAX, check_key, &rc);
+        if (!check_range(&rc, pma->nitems))
+            failed = 1;
 
-        printf("%d %g\n", nkeys,
-                search_time / 1000000.);
+        printf("%llu %g %g\n", (unsigned long long) nkeys,
+                search_time / 1000000.,
+                (double) pma_memory_usage(pma) / nkeys);
 
         fflush(stdout);
         pma_free(pma);
     }
-    return 0;
+    return failed;
 }
@@ -3,6 +3,11 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <perfmon/pfmlib_perf_event.h>
 #include "veb_small_height.h"
 #include "bitlib.h"
@@ -19,21 +24,36 @@ void die(char *s)
     exit(-1);
 }
 
-void permute_array(btrfs_key_t *array, int count)
+void permute_array(btrfs_key_t *array, u64 count)
 {
-    int i, j;
+    u64 i, j;
     btrfs_key_t tmp;
 
     srand(100);
     for (i=0; i < count; i++)
     {
-        j = i + (random() % (count - i));
+        /* random() is 31 bits, too few for the largest arrays */
+        j = i + (((u64) random() << 31 | random()) % (count - i));
         tmp = array[i];
         array[i] = array[j];
         array[j] = tmp;
     }
 }
 
+/* the order of the packed keys in the tree */
+int compare_keys(const void *a, const void *b)
+{
+    const btrfs_key_t *k1 = a, *k2 = b;
+
+    if (k1->objectid != k2->objectid)
+        return k1->objectid < k2->objectid ? -1 : 1;
+    if (k1->type != k2->type)
+        return k1->type < k2->type ? -1 : 1;
+    if (k1->offset != k2->offset)
+        return k1->offset < k2->offset ? -1 : 1;
+    return 0;
+}
+
 void timespec_sub(struct timespec *a, struct timespec *b, struct timespec *res)
 {
     res->tv_sec = a->tv_sec - b->tv_sec;
@@ -48,8 +68,15 @@ void timespec_sub(struct timespec *a, struct timespec *b, struct timespec *res)
 struct timespec start_time;
 struct timespec end_time;
 
-int perf_fds[2];
-u64 perf_values[2][3];
+/* last level cache misses, instructions and data TLB load misses */
+const char *perf_events[] = {
+    "LLC_MISSES",
+    "INSTRUCTION_RETIRED",
+    "PERF_COUNT_HW_CACHE_DTLB:READ:MISS",
+};
+
+int perf_fds[ARRAY_SIZE(perf_events)];
+u64 perf_values[ARRAY_SIZE(perf_events)][3];
 
 void perf_init()
 {
@@ -63,22 +90,19 @@ void perf_start()
 {
     unsigned int i;
     int ret;
-    struct perf_event_attr attr[2];
+    struct perf_event_attr attr[ARRAY_SIZE(perf_events)];
 
     for (i=0; i < ARRAY_SIZE(attr); i++)
         memset(&attr[i], 0, sizeof(attr[0]));
 
-    ret = pfm_get_perf_event_encoding("LLC_MISSES", PFM_PLM3,
-        &attr[0], NULL, NULL);
-
-    if (ret != PFM_SUCCESS)
-        die("couldn't get encoding");
-
-    ret = pfm_get_perf_event_encoding("INSTRUCTION_RETIRED", PFM_PLM3,
-        &attr[1], NULL, NULL);
+    for (i=0; i < ARRAY_SIZE(attr); i++)
+    {
+        ret = pfm_get_perf_event_encoding(perf_events[i], PFM_PLM3,
+            &attr[i], NULL, NULL);
 
-    if (ret != PFM_SUCCESS)
-        die("couldn't get encoding");
+        if (ret != PFM_SUCCESS)
+            die("couldn't get encoding");
+    }
 
     for (i=0; i < ARRAY_SIZE(attr); i++)
     {
@@ -133,7 +157,7 @@ u64 time_elapsed()
 }
 
 /* runs the profile loop and returns total # of us */
-u64 runprof(struct veb *veb, btrfs_key_t *keys, int nkeys, int ntrials)
+u64 runprof(struct veb *veb, btrfs_key_t *keys, u64 nkeys, int ntrials)
 {
     int i;
 
@@ -145,7 +169,7 @@ u64 runprof(struct veb *veb, btrfs_key_t *keys, int nkeys, int ntrials)
     {
         struct tree_node *node;
 
-        int which = i % nkeys;
+        u64 which = i % nkeys;
         node = veb_tree_search(veb, &keys[which]);
         if (node == NULL ||
             node->key.objectid != keys[which].objectid)
@@ -160,6 +184,254 @@ u64 runprof(struct veb *veb, btrfs_key_t *keys, int nkeys, int ntrials)
     return time_elapsed();
 }
 
+/*
+ *  Fault injection: a child inserts the keys, batch keys at a time
+ *  if batch is set, and then deletes them again, while we kill it
+ *  at a random moment.  Then we reopen the tree (which recovers it)
+ *  and check that it is well formed and holds exactly the keys
+ *  whose insert had returned and whose delete had not.  The next
+ *  child carries on from there.  The tree is laid out in blocks of
+ *  the given height, and with leaf blocks of the given height, if any,
+ *  and in durable mode if asked.
+ */
+int crash_test(char *path, int nkeys, int rounds, int batch, int block,
+               int leaf, bool durable)
+{
+    btrfs_key_t *keys = malloc(nkeys * sizeof(*keys));
+    int *done = mmap(NULL, sizeof(*done), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    struct veb *veb;
+    int failures = 0;
+    int r, i;
+    pid_t pid;
+
+    srandom(10);
+    for (i=0; i < nkeys; i++)
+    {
+        keys[i].objectid = random();
+        keys[i].type = random();
+        keys[i].offset = random();
+    }
+
+    *done = 0;
+    veb_tree_free(veb_tree_create(path, 1, block, leaf));
+
+    for (r=0; r < rounds; r++)
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            veb = veb_tree_open(path);
+            veb_tree_set_durable(veb, durable);
+            for (i = *done; i < 2 * nkeys; i++)
+            {
+                if (i >= nkeys)
+                    veb_tree_delete(veb, &keys[i - nkeys]);
+                else if (batch)
+                {
+                    int n = min(batch, nkeys - i);
+
+                    veb_tree_insert_batch(veb, &keys[i], n);
+                    i += n - 1;
+                }
+                else
+                    veb_tree_insert(veb, &keys[i]);
+                __atomic_store_n(done, i + 1, __ATOMIC_RELEASE);
+            }
+            _exit(0);
+        }
+
+        usleep(random() % 100000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        veb = veb_tree_open(path);
+        if (!veb)
+            die("could not reopen tree");
+
+        /* the key being deleted when it died may be either way */
+        bool ok = veb_tree_check(veb);
+        for (i=0; i < min(*done, nkeys); i++)
+            if (i < *done - nkeys)
+                ok &= veb_tree_search(veb, &keys[i]) == NULL;
+            else if (i > *done - nkeys)
+                ok &= veb_tree_search(veb, &keys[i]) != NULL;
+        if (!ok)
+        {
+            printf("round %d: tree damaged after %d ops\n", r, *done);
+            failures++;
+        }
+        veb_tree_free(veb);
+
+        /* start over once every key is in and out again */
+        if (*done == 2 * nkeys)
+        {
+            *done = 0;
+            veb_tree_free(veb_tree_create(path, 1, block, leaf));
+        }
+    }
+    printf("%d kills, %d damaged trees\n", rounds, failures);
+    return failures;
+}
+
+/*
+ *  Delete every key, shrinking the tree as it empties, and return
+ *  the time taken in us.
+ */
+u64 rundelete(struct veb *veb, btrfs_key_t *keys, u64 nkeys)
+{
+    u64 i;
+
+    time_start();
+    for (i=0; i < nkeys; i++)
+        if (veb_tree_delete(veb, &keys[i]) < 0)
+            printf("delete missed key %llu\n", (unsigned long long) i);
+    time_end();
+
+    if (veb->count != 0 || !veb_tree_check(veb))
+        printf("tree not empty after delete\n");
+    return time_elapsed();
+}
+
+/*
+ *  Walk the whole tree in order with a cursor and return the time
+ *  taken in us.  Complains if the keys come out of order or the walk
+ *  does not see every node.
+ */
+u64 runscan(struct veb *veb)
+{
+    struct veb_cursor c;
+    struct tree_node *node;
+    packed_key_t last = { 0, 0 };
+    u64 n = 0;
+
+    time_start();
+    for (node = veb_tree_first(veb, &c); node; node = veb_cursor_next(&c))
+    {
+        if (n++ && (node->key.objectid < last.objectid ||
+                    (node->key.objectid == last.objectid &&
+                     node->key.type_offset <= last.type_offset)))
+            printf("scan out of order at %llu\n", (unsigned long long) n);
+        last = node->key;
+    }
+    time_end();
+
+    if (n != veb->count)
+        printf("scan saw %llu of %llu keys\n", (unsigned long long) n,
+               (unsigned long long) veb->count);
+    return time_elapsed();
+}
+
+struct reader {
+    pthread_t thread;
+    struct veb *veb;
+    btrfs_key_t *keys;
+    u64 nkeys;
+    u64 start;              /* where in keys this reader begins */
+    int ntrials;
+    u64 mincount;           /* keys the scan must see at least */
+    bool writing;           /* a writer is inserting meanwhile */
+    int errors;
+};
+
+struct writer {
+    pthread_t thread;
+    struct veb *veb;
+    int nkeys;
+};
+
+/* fresh random keys, rebalancing and growing under the readers */
+void *writer_thread(void *arg)
+{
+    struct writer *w = arg;
+    btrfs_key_t key;
+    int i;
+
+    for (i=0; i < w->nkeys; i++)
+    {
+        key.objectid = random();
+        key.type = random();
+        key.offset = random();
+        veb_tree_insert(w->veb, &key);
+    }
+    return NULL;
+}
+
+/* lookups over the reader's share of keys, then one full scan */
+void *reader_thread(void *arg)
+{
+    struct reader *r = arg;
+    struct veb_cursor c;
+    struct tree_node *node;
+    u64 n = 0;
+    int i;
+
+    for (i=0; i < r->ntrials; i++)
+    {
+        btrfs_key_t *key = &r->keys[(r->start + i) % r->nkeys];
+        btrfs_key_t found;
+
+        /* a node found under a writer may move, so take a copy */
+        if (!veb_tree_lookup(r->veb, key, &found) ||
+            found.objectid != key->objectid || found.type != key->type ||
+            found.offset != key->offset)
+            r->errors++;
+    }
+
+    for (node = veb_tree_first(r->veb, &c); node; node = veb_cursor_next(&c))
+        n++;
+    if (n < r->mincount || (!r->writing && n != r->veb->count))
+        r->errors++;
+
+    return NULL;
+}
+
+/*
+ *  Read throughput: ntrials lookups split over nthreads readers,
+ *  each of which also scans the whole tree with its own cursor.
+ *  With nwrites, one writer inserts that many new keys meanwhile and
+ *  every existing key must still be found.  Returns total # of us.
+ */
+u64 runthreads(struct veb *veb, btrfs_key_t *keys, u64 nkeys, int ntrials,
+               int nthreads, int nwrites, int *errors)
+{
+    struct reader *r = calloc(nthreads, sizeof(*r));
+    struct writer w = { .veb = veb, .nkeys = nwrites };
+    int i;
+
+    time_start();
+    if (nwrites && pthread_create(&w.thread, NULL, writer_thread, &w))
+        die("couldn't start writer");
+    for (i=0; i < nthreads; i++)
+    {
+        r[i].veb = veb;
+        r[i].keys = keys;
+        r[i].nkeys = nkeys;
+        r[i].start = i * nkeys / nthreads;
+        r[i].ntrials = ntrials / nthreads;
+        r[i].mincount = veb->count;
+        r[i].writing = nwrites != 0;
+        if (pthread_create(&r[i].thread, NULL, reader_thread, &r[i]))
+            die("couldn't start reader");
+    }
+
+    *errors = 0;
+    for (i=0; i < nthreads; i++)
+    {
+        pthread_join(r[i].thread, NULL);
+        *errors += r[i].errors;
+    }
+    if (nwrites)
+        pthread_join(w.thread, NULL);
+    time_end();
+
+    if (nwrites && !veb_tree_check(veb))
+        (*errors)++;
+
+    free(r);
+    return time_elapsed();
+}
+
 void *empty_cache()
 {
     /* try to kill the cache */
@@ -180,23 +452,35 @@ double perf_scale(int i)
         perf_values[i][2];
 }
 
-#define MAX_KEYS (1 << 30)
+/* the sweep goes up to 2^32 keys, past what 32-bit positions could hold */
+#define MAX_KEYS (1ULL << 32)
 //#define NTRIALS (100000000)
 #define NTRIALS (1000000)
 int main(int argc, char *argv[])
 {
-    int i;
-    int nkeys = 1 << 8;
-    int max_keys = MAX_KEYS;
+    u64 i;
+    u64 nkeys = 1 << 8;
+    u64 max_keys = MAX_KEYS;
     struct veb *veb;
     btrfs_key_t *values;
     u64 insert_time = 0;
     u64 search_time = 0;
+    u64 allocs;
     int opt;
-    bool do_inserts = false, do_searches = false;
+    bool do_inserts = false, do_searches = false, do_scan = false;
+    bool do_build = false, do_delete = false;
     bool clear = true;
-
-    while ((opt = getopt(argc, argv, "isk:")) != -1)
+    bool durable = false;
+    char *path = "veb_tree.dat";
+    int flush_ms = 0;
+    int crash_rounds = 0;
+    int nthreads = 0;
+    int nwrites = 0;
+    int batch = 0;
+    int block = 0;
+    int leaf = 0;
+
+    while ((opt = getopt(argc, argv, "isrBdDk:f:F:c:t:w:b:L:l:")) != -1)
     {
         switch(opt) {
         case 'i':
@@ -205,41 +489,110 @@ int main(int argc, char *argv[])
         case 's':
             do_searches = true;
             break;
+        case 'r':
+            do_scan = true;
+            break;
+        case 'B':
+            do_build = true;
+            break;
+        case 'd':
+            do_delete = true;
+            break;
+        case 'D':
+            durable = true;
+            break;
         case 'k':
-            nkeys = max_keys = atoi(optarg);
+            nkeys = max_keys = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        case 'F':
+            flush_ms = atoi(optarg);
+            break;
+        case 'c':
+            crash_rounds = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'w':
+            nwrites = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'L':
+            block = atoi(optarg);
+            break;
+        case 'l':
+            leaf = atoi(optarg);
             break;
         default:
             die("unknown param");
         }
     }
-    if (!do_inserts && !do_searches)
+    if (crash_rounds)
+        return crash_test(path, max_keys, crash_rounds, batch, block,
+                          leaf, durable) ? 1 : 0;
+
+    if (!do_inserts && !do_searches && !do_build)
         do_inserts = do_searches = true;
 
-    clear = do_inserts;
+    clear = do_inserts || do_build;
 
     perf_init();
 
     srandom(10);
     for (; nkeys <= max_keys; nkeys <<= 1)
     {
-        veb = veb_tree_new(nkeys/8, clear);
+        veb = clear ? veb_tree_create(path, nkeys/8, block, leaf) : veb_tree_open(path);
+        if (!veb)
+            die("could not set up tree");
+        veb_tree_set_durable(veb, durable);
+        if (flush_ms)
+            veb_tree_start_flusher(veb, flush_ms);
         values = malloc(nkeys * sizeof(btrfs_key_t));
 
+        allocs = veb->allocs;
         time_start();
         for (i=0; i < nkeys; i++)
         {
             values[i].objectid = random();
             values[i].type = random();
             values[i].offset = random();
-            if (do_inserts)
+            if (do_inserts && !batch && !do_build)
                 veb_tree_insert(veb, &values[i]);
         }
+        /* or load them batch keys at a time */
+        for (i=0; do_inserts && batch && !do_build && i < nkeys; i += batch)
+            veb_tree_insert_batch(veb, &values[i], min((u64) batch,
+                                                       nkeys - i));
         time_end();
         insert_time = time_elapsed();
 
-        permute_array(values, nkeys);
+        /* or build the tree in one go from the keys, sorted first */
+        if (do_build)
+        {
+            veb_tree_free(veb);
+            qsort(values, nkeys, sizeof(*values), compare_keys);
+            time_start();
+            veb = veb_tree_build_sorted(path, values, nkeys, 0, block,
+                                        leaf);
+            time_end();
+            if (!veb)
+                die("could not build tree");
+            veb_tree_set_durable(veb, durable);
+            if (flush_ms)
+                veb_tree_start_flusher(veb, flush_ms);
+            insert_time = time_elapsed();
+            allocs = veb->allocs;
+        }
+
+        /* the insert path should not allocate at all */
+        allocs = veb->allocs - allocs;
 
-        pointerize(veb);
+        permute_array(values, nkeys);
 
         free(empty_cache());
 
@@ -248,11 +601,41 @@ int main(int argc, char *argv[])
 
         double misses = perf_scale(0);
         double cycles = perf_scale(1);
+        double tlb_misses = perf_scale(2);
+
+        /* bytes of the mapped file the node array spans */
+        u64 file_bytes = sizeof(struct tree_node) * veb->span;
 
-        printf("%d %g %g %g %g\n", ilog2(nkeys), search_time / 1000000.,
+        printf("%d %g %g %g %g %llu %llu %g\n", ilog2_64(nkeys),
+               search_time / 1000000.,
                insert_time / 1000000.,
                cycles,
-               misses);
+               misses,
+               (unsigned long long) allocs,
+               (unsigned long long) file_bytes,
+               tlb_misses);
+
+        if (do_scan)
+            printf("scan %llu %g\n", (unsigned long long) veb->count,
+                   runscan(veb) / 1000000.);
+
+        if (nthreads)
+        {
+            int errors;
+            u64 us = runthreads(veb, values, nkeys, NTRIALS, nthreads,
+                                nwrites, &errors);
+
+            printf("threads %d %g Mlookups/s %d errors\n", nthreads,
+                   (double) NTRIALS / us, errors);
+        }
+
+        if (do_delete)
+        {
+            double secs = rundelete(veb, values, nkeys) / 1000000.;
+
+            printf("delete %llu %g %llu\n", (unsigned long long) nkeys, secs,
+                   (unsigned long long) veb->map_size);
+        }
 
         fflush(stdout);
         veb_tree_free(veb);
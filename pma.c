@@ -3,10 +3,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "vebtree.h"
 #include "types.h"
 #include "bitlib.h"
+#include "valuelog.h"
 
 /*
  *  A packed memory array is a resizing array storing ordered values.
@@ -22,11 +31,178 @@
  */
 
 static int rebalance_insert(struct pma *p, int start, int height,
-                            int occupation, int newval);
+                            int occupation, const void *new_elem);
+static void pma_stop_deferred(struct pma *p);
+static void migrate_window(struct pma *p, int start, int height);
+static int grow_begin(struct pma *p);
+static void grow_finish(struct pma *p);
+static int old_segment_keys(struct pma *p, int seg, key_t *keys);
+
+/* don't bother compacting the value log below this much garbage */
+#define VLOG_COMPACT_MIN (1 << 20)
+
+/* Room for one element of either kind */
+union pma_elem {
+    struct leaf leaf;
+    struct vleaf vleaf;
+};
+
+/* old segments moved to the grown array per insert */
+#define PMA_MIGRATE_STEP 4
+
+/* An insert that didn't fit in its unmigrated segment */
+struct pma_pending {
+    union pma_elem e;
+    int next;           /* next pending for the same segment, +1 */
+};
 
-static bool empty(struct leaf *array, int index)
+/*
+ *  An incremental grow in progress.  Old segment j moves to new
+ *  segments 2j and 2j+1; segments below next have moved.  Every key
+ *  below frontier is in the new array, the rest are in the old array
+ *  or pending.
+ *
+ *  Each insert parks at most one element, so the pending pool is
+ *  sized by the number of inserts the migration can take.  Lists are
+ *  linked by index + 1 so that a zeroed head means empty.
+ *
+ *  A compressed PMA keeps its old segments in csegs instead of region.
+ */
+struct pma_migration {
+    void *region;
+    struct pma_cseg *csegs;
+    struct veb *index;
+    int size;
+    int segsize;
+    int nsegs;
+    int next;
+    key_t frontier;
+    int *pending_head;
+    struct pma_pending *pending;
+    int npending;
+    int max_pending;
+};
+
+/*
+ *  Memory given up by a grow.  Unmapping a big array all at once
+ *  costs as much as touching it did, so it is unmapped from the end
+ *  a piece per insert instead.
+ */
+struct pma_retired {
+    char *mem;
+    size_t bytes;       /* still mapped, a whole number of pages */
+    struct pma_retired *next;
+};
+
+/* bytes of retired memory unmapped per insert */
+#define PMA_RELEASE_STEP (64 << 10)
+
+/* number of inserts that may wait for the background rebalancer */
+#define PMA_BACKLOG 256
+
+/* inserts the rebalancer applies before letting searches in */
+#define PMA_BATCH_STEP 8
+
+/*
+ *  State for deferred rebalancing (see pma_start_deferred).  lock
+ *  covers the array, the index and the batch being applied; qlock
+ *  covers the backlog.  Lock order is lock, then qlock.
+ */
+struct pma_deferred {
+    pthread_t worker;
+    pthread_rwlock_t lock;
+    pthread_mutex_t qlock;
+    pthread_cond_t work;        /* backlog is non-empty, or stop */
+    pthread_cond_t room;        /* backlog has drained some */
+    union pma_elem backlog[PMA_BACKLOG];
+    union pma_elem batch[PMA_BACKLOG];
+    int nbatch, applied;        /* batch entries, those in the array */
+    int head, len;
+    int busy, stop;
+};
+
+/*
+ *  Zeroed memory straight from mmap.  The kernel zeroes each page as
+ *  it is first touched, so a doubled array costs nothing until the
+ *  migration reaches it; calloc() may reuse heap and clear it all up
+ *  front.
+ */
+static void *zero_alloc(size_t bytes)
+{
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void zero_free(void *mem, size_t bytes)
+{
+    if (mem)
+        munmap(mem, bytes);
+}
+
+static void retire(struct pma *p, void *mem, size_t bytes)
+{
+    struct pma_retired *r;
+    size_t page = getpagesize();
+
+    if (!mem)
+        return;
+
+    r = malloc(sizeof(*r));
+    if (!r)
+    {
+        munmap(mem, bytes);
+        return;
+    }
+    r->mem = mem;
+    r->bytes = (bytes + page - 1) & ~(page - 1);
+    r->next = p->retired;
+    p->retired = r;
+}
+
+/* unmap up to budget bytes of retired memory */
+static void release_step(struct pma *p, size_t budget)
+{
+    struct pma_retired *r;
+    size_t chunk;
+
+    while ((r = p->retired) && budget)
+    {
+        chunk = min(r->bytes, budget);
+        r->bytes -= chunk;
+        budget -= chunk;
+        munmap(r->mem + r->bytes, chunk);
+
+        if (!r->bytes)
+        {
+            p->retired = r->next;
+            free(r);
+        }
+    }
+}
+
+static inline void *elem(struct pma *p, int index)
+{
+    return (char *) p->region + (size_t) index * p->elem_size;
+}
+
+static inline key_t elem_key(struct pma *p, const void *e)
+{
+    if (p->vlog)
+        return ((const struct vleaf *) e)->key;
+
+    return ((const struct leaf *) e)->key;
+}
+
+static inline key_t key_at(struct pma *p, int index)
+{
+    return elem_key(p, elem(p, index));
+}
+
+static bool empty(struct pma *p, int index)
 {
-    return array[index].key == 0;
+    return key_at(p, index) == 0;
 }
 
 static key_t scan_minimum(struct pma *p, int start, int size)
@@ -35,26 +211,239 @@ static key_t scan_minimum(struct pma *p, int start, int size)
 
     for (i=start; i < start + size; i++)
     {
-        if (!empty(p->region, i))
-            return p->region[i].key;
+        if (!empty(p, i))
+            return key_at(p, i);
+    }
+    return 0;
+}
+
+/*
+ *  Compressed segments.
+ *
+ *  Keys within a segment are sorted and usually close together, so a
+ *  compressed segment stores its smallest key as a base and each key
+ *  as a delta from it (frame-of-reference).  All deltas in a segment
+ *  use the narrowest of 0, 1, 2 or 4 bytes that holds the largest
+ *  one.  Lanes are kept byte-aligned so that a search can compare a
+ *  whole segment against the wanted delta with SSE2 instead of
+ *  unpacking it first.
+ *
+ *  Compressed segments have no gaps: every insert rewrites the
+ *  segments of its window as a unit in rebalance_insert().
+ */
+static int cseg_width(u32 max_delta)
+{
+    if (!max_delta)
+        return 0;
+    if (max_delta <= 0xff)
+        return 1;
+    if (max_delta <= 0xffff)
+        return 2;
+    return 4;
+}
+
+static u32 cseg_delta(struct pma_cseg *s, int i)
+{
+    switch (s->width)
+    {
+    case 1:
+        return s->deltas[i];
+    case 2:
+        return ((u16 *) s->deltas)[i];
+    case 4:
+        return ((u32 *) s->deltas)[i];
+    }
+    return 0;
+}
+
+static int cseg_decode(struct pma_cseg *s, key_t *keys)
+{
+    int i;
+
+    for (i=0; i < s->count; i++)
+        keys[i] = s->base + cseg_delta(s, i);
+
+    return s->count;
+}
+
+static void cseg_encode(struct pma_cseg *s, key_t *keys, int n)
+{
+    int i, bytes;
+
+    s->count = n;
+    s->base = n ? keys[0] : 0;
+    s->width = n ? cseg_width((u32) keys[n-1] - (u32) keys[0]) : 0;
+
+    /* pad to a whole vector so cseg_find() never reads past the end */
+    bytes = (n * s->width + 15) & ~15;
+    if (bytes > s->cap)
+    {
+        s->deltas = realloc(s->deltas, bytes);
+        s->cap = bytes;
+    }
+
+    for (i=0; i < n; i++)
+    {
+        u32 delta = (u32) keys[i] - (u32) s->base;
+
+        switch (s->width)
+        {
+        case 1:
+            s->deltas[i] = delta;
+            break;
+        case 2:
+            ((u16 *) s->deltas)[i] = delta;
+            break;
+        case 4:
+            ((u32 *) s->deltas)[i] = delta;
+            break;
+        }
+    }
+}
+
+/*
+ *  Returns the index of key in the segment, or -1 if it is not there.
+ */
+static int cseg_find(struct pma_cseg *s, key_t key)
+{
+    u32 target = (u32) key - (u32) s->base;
+    int i;
+
+    if (!s->count || key < s->base)
+        return -1;
+
+    if (!s->width)
+        return target ? -1 : 0;
+
+    if (s->width < 4 && (target >> (8 * s->width)))
+        return -1;
+
+#ifdef __SSE2__
+    {
+        int lanes = 16 / s->width;
+        __m128i want, v, eq;
+        unsigned int mask;
+
+        if (s->width == 1)
+            want = _mm_set1_epi8((char) target);
+        else if (s->width == 2)
+            want = _mm_set1_epi16((short) target);
+        else
+            want = _mm_set1_epi32((int) target);
+
+        for (i=0; i < s->count; i += lanes)
+        {
+            v = _mm_loadu_si128((__m128i *) &s->deltas[i * s->width]);
+
+            if (s->width == 1)
+                eq = _mm_cmpeq_epi8(v, want);
+            else if (s->width == 2)
+                eq = _mm_cmpeq_epi16(v, want);
+            else
+                eq = _mm_cmpeq_epi32(v, want);
+
+            mask = _mm_movemask_epi8(eq);
+            if (mask)
+            {
+                /* the first hit may be in the padding past count */
+                i += __builtin_ctz(mask) / s->width;
+                return i < s->count ? i : -1;
+            }
+        }
     }
+#else
+    for (i=0; i < s->count; i++)
+        if (cseg_delta(s, i) == target)
+            return i;
+#endif
+    return -1;
+}
+
+/*
+ *  Add key to a segment holding fewer than cap keys.  Returns -1 if
+ *  the segment is already full.
+ */
+static int cseg_insert(struct pma_cseg *s, int cap, key_t key)
+{
+    key_t keys[64];
+    int i, n;
+
+    if (s->count >= cap)
+        return -1;
+
+    n = cseg_decode(s, keys);
+    for (i = n; i > 0 && keys[i-1] > key; i--)
+        keys[i] = keys[i-1];
+    keys[i] = key;
+
+    cseg_encode(s, keys, n + 1);
     return 0;
 }
 
+/*
+ *  Spread n sorted keys evenly over nsegs compressed segments
+ *  starting at first.
+ */
+static void cseg_spread(struct pma *p, int first, int nsegs,
+                        key_t *keys, int n)
+{
+    int i;
+    int ofs = 0;
+
+    for (i=0; i < nsegs; i++)
+    {
+        int next = (int) (((long long) n * (i + 1)) / nsegs);
+
+        assert(next - ofs <= p->segsize);
+        cseg_encode(&p->csegs[first + i], &keys[ofs], next - ofs);
+        ofs = next;
+    }
+}
+
+static key_t segment_minimum(struct pma *p, int seg)
+{
+    if (p->compressed)
+        return p->csegs[seg].count ? p->csegs[seg].base : 0;
+
+    return scan_minimum(p, seg * p->segsize, p->segsize);
+}
+
+static int segment_count(struct pma *p, int seg)
+{
+    int i, n = 0;
+
+    if (p->compressed)
+        return p->csegs[seg].count;
+
+    for (i = seg * p->segsize; i < (seg + 1) * p->segsize; i++)
+        if (!empty(p, i))
+            n++;
+
+    return n;
+}
+
+/* recompute an inner index node and its key count from its children */
+static void recompute_node(struct pma *p, int bfs_index)
+{
+    veb_tree_recompute_index(p->index, bfs_index);
+    p->occupied[bfs_index] = p->occupied[2 * bfs_index] +
+                             p->occupied[2 * bfs_index + 1];
+}
+
 /*
  *  Set the keys in the veb tree to match the values stored in
  *  the PMA.  We just scan the start of each window and load those
  *  values directly into the tree.
  *
  *  Height in this case is the total max height, not height index.
- *
- *  TODO: there is probably a better way -- updating the nodes as
- *  we rebalance the array and maintaining min/max as in an
- *  interval tree, but when items move from one window to the next
- *  it gets a little tricky.
+ *  The number of keys under each node is kept alongside, so that the
+ *  density of a window is a lookup.
  *
  *  At the leafs: take the first entry in each segment.
- *  At the nonleafs: take the leftmost child of the right subtree
+ *  At the nonleafs: take the smallest key of the right subtree,
+ *  skipping empty segments.  Empty segments would otherwise misroute
+ *  keys, and skipping them also leaves the unmigrated half of a grow
+ *  out of the search path.
  */
 static void rebuild_index(struct pma *p, int start, int height)
 {
@@ -70,12 +459,15 @@ static void rebuild_index(struct pma *p, int start, int height)
     int leaf_end = window_end / p->segsize;
     for (i=leaf_start; i < leaf_end; i++)
     {
-        key_t minval = scan_minimum(p, i * p->segsize, p->segsize);
+        key_t minval = segment_minimum(p, i);
 
         int bfs_index = p->nsegs + i;
 
         veb_tree_set_node_key(p->index, bfs_index, minval);
-        veb_tree_link_leaf(p->index, bfs_index, &p->region[i * p->segsize]);
+        p->occupied[bfs_index] = segment_count(p, i);
+        if (p->region && !p->vlog)
+            veb_tree_link_leaf(p->index, bfs_index,
+                               elem(p, i * p->segsize));
     }
     /* now recompute the parent nodes */
     for (i=1; i < height; i++)
@@ -85,11 +477,34 @@ static void rebuild_index(struct pma *p, int start, int height)
         for (j=leaf_start; j < leaf_end; j++)
         {
             int bfs_index = (p->nsegs >> i) + j;
-            veb_tree_recompute_index(p->index, bfs_index);
+            recompute_node(p, bfs_index);
         }
     }
 }
 
+/*
+ *  Returns room for n keys, for decoding compressed segments into.
+ *  The buffer is kept with the pma and only grows, so a rebalance
+ *  doesn't allocate.  NULL if it can't be grown.
+ */
+static key_t *pma_scratch(struct pma *p, int n)
+{
+    key_t *keys;
+    int cap;
+
+    if (n <= p->scratch_cap)
+        return p->scratch;
+
+    cap = max(n, 2 * p->scratch_cap);
+    keys = realloc(p->scratch, sizeof(*keys) * cap);
+    if (!keys)
+        return NULL;
+
+    p->scratch = keys;
+    p->scratch_cap = cap;
+    return keys;
+}
+
 /*
  *  Reallocates a PMA to be at least as large as new_size.
  *
@@ -105,42 +520,96 @@ static void rebuild_index(struct pma *p, int start, int height)
  *
  *  With an empty struct pma, performs initial allocation.
  */
-static void pma_reallocate(struct pma *p, int new_size)
+static int pma_reallocate(struct pma *p, int new_size)
 {
-    int old_size = p->size;
+    int old_nsegs = p->nsegs;
+    key_t *keys = NULL;
+    int count = 0;
+    int i;
 
     int round_up_size = hyperceil(new_size);
+    int segsize = ilog2(round_up_size);
+    int nsegs = hyperceil(round_up_size / segsize);
+    size_t bytes, old_bytes;
+    void *region;
+    int *occupied;
+
+    /*
+     * Compressed segments can't be spread in place across the new
+     * segment boundaries, so pull all the keys out first.
+     */
+    if (p->compressed)
+    {
+        keys = pma_scratch(p, p->nitems + 1);
+        if (!keys)
+            return -ENOMEM;
+        for (i=0; i < old_nsegs; i++)
+            count += cseg_decode(&p->csegs[i], &keys[count]);
+
+        bytes = sizeof(*p->csegs) * nsegs;
+        old_bytes = sizeof(*p->csegs) * old_nsegs;
+    }
+    else
+    {
+        bytes = (size_t) p->elem_size * nsegs * segsize;
+        old_bytes = (size_t) p->elem_size * p->size;
+    }
+
+    region = zero_alloc(bytes);
+    occupied = zero_alloc(sizeof(*occupied) * 2 * nsegs);
+    if (!region || !occupied)
+    {
+        zero_free(region, bytes);
+        zero_free(occupied, sizeof(*occupied) * 2 * nsegs);
+        return -ENOMEM;
+    }
+
+    if (p->compressed)
+    {
+        for (i=0; i < old_nsegs; i++)
+            free(p->csegs[i].deltas);
+        zero_free(p->csegs, old_bytes);
+        p->csegs = region;
+    }
+    else
+    {
+        if (p->region)
+            memcpy(region, p->region, min(bytes, old_bytes));
+        zero_free(p->region, old_bytes);
+        p->region = region;
+    }
+    zero_free(p->occupied, sizeof(*p->occupied) * 2 * old_nsegs);
+    p->occupied = occupied;
 
-    p->segsize = ilog2(round_up_size);
-    p->nsegs = hyperceil(round_up_size / p->segsize);
+    p->segsize = segsize;
+    p->nsegs = nsegs;
     p->size = p->nsegs * p->segsize;
-    p->region = realloc(p->region, sizeof(*p->region) * p->size);
     p->height = ilog2(p->nsegs) + 1;
 
-    memset(&p->region[old_size], 0,
-           (p->size - old_size) * sizeof(*p->region));
-
     if (p->index)
         veb_tree_free(p->index);
 
     p->index = veb_tree_new(p->nsegs);
 
-    rebalance_insert(p, 0, p->height-1, p->nitems, 0);
+    if (p->compressed)
+        cseg_spread(p, 0, p->nsegs, keys, count);
+    else
+        rebalance_insert(p, 0, p->height-1, p->nitems, NULL);
+
     rebuild_index(p, 0, p->height);
+    return 0;
 }
 
-/*
- *  Constructs a new PMA of the given size.
- *
- *  initial_size is rounded up so that the number of segments
- *  is a power of two.
- */
-struct pma *pma_new(int initial_size)
+static struct pma *pma_alloc(int initial_size, int compressed,
+                             struct vlog *vlog)
 {
     struct pma *p = malloc(sizeof(*p));
 
     memset(p, 0, sizeof(*p));
 
+    p->compressed = compressed;
+    p->vlog = vlog;
+    p->elem_size = vlog ? sizeof(struct vleaf) : sizeof(struct leaf);
     pma_reallocate(p, initial_size);
 
     p->max_seg_density = 0.92;
@@ -152,91 +621,243 @@ struct pma *pma_new(int initial_size)
     return p;
 }
 
-void pma_free(struct pma *p)
+/*
+ *  Constructs a new PMA of the given size.
+ *
+ *  initial_size is rounded up so that the number of segments
+ *  is a power of two.
+ */
+struct pma *pma_new(int initial_size)
 {
+    return pma_alloc(initial_size, 0, NULL);
 }
 
-static void pma_grow(struct pma *p)
+/*
+ *  Constructs a new PMA that keeps its segments compressed.  Only
+ *  keys are stored; pma_search() returns a copy of the key that is
+ *  valid until the next search.
+ */
+struct pma *pma_new_compressed(int initial_size)
 {
-    printf("before grow, size = %d, height = %d\n", p->size, p->height);
-    pma_reallocate(p, p->size * 2);
-    printf("after grow, size = %d, height = %d\n", p->size, p->height);
+    return pma_alloc(initial_size, 1, NULL);
 }
 
-void pma_print(struct pma *p)
+/*
+ *  Constructs a new PMA whose values live in an append-only value
+ *  log, so that the array itself only holds a key and a handle per
+ *  item and values can be of any size.  The log is kept in the file
+ *  at path, or in anonymous memory if path is NULL.
+ */
+struct pma *pma_new_vlog(int initial_size, const char *path)
+{
+    return pma_alloc(initial_size, 0, vlog_new(path));
+}
+
+/*
+ *  Returns the number of bytes used to hold the keys.
+ */
+size_t pma_memory_usage(struct pma *p)
 {
+    size_t bytes;
     int i;
-    for (i = 0; i < p->size; i++)
+
+    if (!p->compressed)
     {
-        if (empty(p->region, i))
-            printf(".. ");
-        else
-            printf("%02d ", p->region[i].key);
+        bytes = (size_t) p->elem_size * p->size;
+        if (p->migration)
+            bytes += (size_t) p->elem_size * p->migration->size;
+        return bytes;
+    }
+
+    bytes = sizeof(*p->csegs) * p->nsegs;
+    for (i=0; i < p->nsegs; i++)
+        bytes += p->csegs[i].cap;
+
+    if (p->migration)
+    {
+        bytes += sizeof(*p->csegs) * p->migration->nsegs;
+        for (i=0; i < p->migration->nsegs; i++)
+            bytes += p->migration->csegs[i].cap;
+    }
+    return bytes;
+}
+
+void pma_free(struct pma *p)
+{
+    int i;
+
+    if (p->deferred)
+        pma_stop_deferred(p);
+
+    if (p->migration)
+        grow_finish(p);
+
+    if (p->compressed)
+    {
+        for (i=0; i < p->nsegs; i++)
+            free(p->csegs[i].deltas);
+        zero_free(p->csegs, sizeof(*p->csegs) * p->nsegs);
+    }
+    if (p->vlog)
+        vlog_free(p->vlog);
+
+    zero_free(p->region, (size_t) p->elem_size * p->size);
+    zero_free(p->occupied, sizeof(*p->occupied) * 2 * p->nsegs);
+    release_step(p, SIZE_MAX);
+    free(p->scratch);
+    veb_tree_free(p->index);
+    free(p);
+}
+
+void pma_print(struct pma *p)
+{
+    key_t keys[64];
+    int i, j, n;
+
+    if (p->compressed)
+    {
+        for (i = 0; i < p->nsegs; i++)
+        {
+            n = cseg_decode(&p->csegs[i], keys);
+            for (j = 0; j < n; j++)
+                printf("%02d ", keys[j]);
+            printf("| ");
+        }
+    }
+    else
+    {
+        for (i = 0; i < p->size; i++)
+        {
+            if (empty(p, i))
+                printf(".. ");
+            else
+                printf("%02d ", key_at(p, i));
+        }
+    }
+
+    /* keys still waiting to move into the grown array */
+    if (p->migration)
+    {
+        printf("|| ");
+        for (i = p->migration->next; i < p->migration->nsegs; i++)
+        {
+            n = old_segment_keys(p, i, keys);
+            for (j = 0; j < n; j++)
+                printf("%02d ", keys[j]);
+            printf("| ");
+        }
     }
     printf("\n");
 }
 
+/*
+ *  Rewrite all of the compressed segments in a window with their
+ *  keys (plus new_key, if insert is set) spread evenly between them.
+ */
+static int rebalance_insert_compressed(struct pma *p, int start, int height,
+                                       int occupation, key_t new_key,
+                                       bool insert)
+{
+    int window_segs = 1 << height;
+    int first = (start / p->segsize) & ~(window_segs - 1);
+    key_t *keys;
+    int count = 0;
+    int i;
+
+    keys = pma_scratch(p, occupation + 1);
+    if (!keys)
+        return -ENOMEM;
+
+    for (i = first; i < first + window_segs; i++)
+        count += cseg_decode(&p->csegs[i], &keys[count]);
+
+    if (insert)
+    {
+        for (i = count; i > 0 && keys[i-1] > new_key; i--)
+            keys[i] = keys[i-1];
+        keys[i] = new_key;
+        count++;
+        p->nitems++;
+    }
+
+    cseg_spread(p, first, window_segs, keys, count);
+    return 0;
+}
+
 static int rebalance_insert(struct pma *p, int start, int height,
-                            int occupation, key_t new_key)
+                            int occupation, const void *new_elem)
 {
     int window_size = p->segsize * (1 << height);
     int window_start = start - start % window_size;
     int window_end = window_start + window_size;
     int length = window_size;
     int i, j;
-    int pos;
+    long long pos, stride;
+    union pma_elem pending, tmp;
 
     assert(window_size <= p->size);
 
-    if (new_key)
+    if (p->compressed)
+        return rebalance_insert_compressed(p, start, height, occupation,
+                                           new_elem ? elem_key(p, new_elem) : 0,
+                                           new_elem != NULL);
+
+    if (new_elem)
+    {
+        memcpy(&pending, new_elem, p->elem_size);
         occupation += 1;
+    }
 
     if (!occupation)
         return 0;
 
     /* stride is number of extra spaces to add per non-empty item,
-     * in fixed-point with 8-bits of resolution
+     * in fixed-point with 8-bits of resolution.  Positions shifted by
+     * 8 bits pass 2^31 in windows past 2^23 slots, so both are 64-bit.
      */
-    unsigned int stride = ((length - occupation) << 8) / occupation;
+    stride = ((long long) (length - occupation) << 8) / occupation;
 
     /* First move all of the elements to the left, including the
-     * item we wish to insert
+     * item we wish to insert.  Whole elements move, so values stay
+     * with their keys.
      */
     for (i=j=window_start; i < window_end; i++)
     {
-        if (!empty(p->region, i))
+        if (!empty(p, i))
         {
             /* insert new value in the proper place */
-            if (new_key && p->region[i].key > new_key) {
+            if (new_elem && key_at(p, i) > elem_key(p, &pending)) {
 
                 /* swap it out so we don't overwrite anything */
-                key_t tmp = p->region[i].key;
-                p->region[j++].key = new_key;
-                new_key = tmp;
+                memcpy(&tmp, elem(p, i), p->elem_size);
+                memcpy(elem(p, j++), &pending, p->elem_size);
+                memcpy(&pending, &tmp, p->elem_size);
             }
             else
-                p->region[j++].key = p->region[i].key;
+                memmove(elem(p, j++), elem(p, i), p->elem_size);
         }
     }
-    if (new_key)
+    if (new_elem)
     {
-        p->region[j++].key = new_key;
+        memcpy(elem(p, j++), &pending, p->elem_size);
         p->nitems++;
     }
 
     /* zero rest of array */
-    memset(&p->region[j], 0, (window_end - j) * sizeof(p->region[0]));
+    memset(elem(p, j), 0, (size_t) (window_end - j) * p->elem_size);
 
     /* now redistribute from the right.  We compute the target
      * spaces using fixed-point in pos.
      */
-    pos = ((window_end - 1) << 8) - stride;
+    pos = ((long long) (window_end - 1) << 8) - stride;
     for (i = j-1; i >= window_start; i--)
     {
         j = pos >> 8;
-        p->region[j].key = p->region[i].key;
         if (j != i)
-            p->region[i].key= 0;
+        {
+            memcpy(elem(p, j), elem(p, i), p->elem_size);
+            memset(elem(p, i), 0, p->elem_size);
+        }
 
         pos -= (1 << 8) + stride;
     }
@@ -247,7 +868,8 @@ static double target_density(struct pma *p, int height)
 {
     int max_height = p->height - 1;
 
-    double result = p->max_density + (p->max_density - p->max_seg_density) *
+    /* from max_seg_density at the segments down to max_density at the root */
+    double result = p->max_density + (p->max_seg_density - p->max_density) *
         (max_height - height)/(double) max_height;
 
     return result;
@@ -255,56 +877,56 @@ static double target_density(struct pma *p, int height)
 
 /*
  *  Compute the density of a window at a certain start position
- *  and tree height.
+ *  and tree height, from the key counts kept with the index.
  */
 static double density(struct pma *p, int start, int height, int *occupation)
 {
-    int occupied = 0;
-    int i;
-
-    /* scan backwards to the window start and ahead to the window end */
     int window_size = p->segsize * (1 << height);
-    int window_start = start - start % window_size;
-    int window_end = window_start + window_size;
-
-    for (i = start; i >= window_start; i--)
-        if (!empty(p->region, i))
-            occupied++;
-
-    for (i = start + 1; i < window_end; i++)
-        if (!empty(p->region, i))
-            occupied++;
 
-    *occupation = occupied;
+    *occupation = p->occupied[(p->nsegs + start / p->segsize) >> height];
 
-    return (double)occupied / window_size;
+    return (double) *occupation / window_size;
 }
 
-/* insert y at pointer x.  can be binary search or tree driven. */
-static void pma_insert_at(struct pma *p, int x, int y)
+/*
+ *  Insert y at pointer x.  can be binary search or tree driven.
+ *  Returns the height of the window that was rebalanced, -EAGAIN if
+ *  the array started to grow instead, in which case x is stale and
+ *  the caller has to route y again, or -ENOMEM.
+ */
+static int pma_insert_at(struct pma *p, int x, const void *y)
 {
     int occupation = 0;
     int height = 0;
+    int ret;
 
-    while (density(p, x, height, &occupation) > target_density(p, height))
+    for (;;)
     {
+        if (p->migration)
+            migrate_window(p, x, height);
+
+        if (density(p, x, height, &occupation) <= target_density(p, height))
+            break;
+
         height++;
 
-        /* requested height is taller than the tree, double the size */
+        /*
+         *  requested height is taller than the tree, double the size.
+         *  x is stale afterwards, so the caller has to route y again.
+         */
         if (height >= p->height)
         {
-            pma_grow(p);
-            height--;
+            ret = grow_begin(p);
+            return ret ? ret : -EAGAIN;
         }
     }
 
-    assert(height < p->height);
-
     /* rebalance this window and add y */
-    rebalance_insert(p, x, height, occupation, y);
+    ret = rebalance_insert(p, x, height, occupation, y);
+    return ret ? ret : height;
 }
 
-static bool pma_bin_search(struct leaf *region, int min_i, int max_i, int value,
+static bool pma_bin_search(struct pma *p, int min_i, int max_i, int value,
                     int *ins_pt)
 {
     int mid;
@@ -316,24 +938,24 @@ static bool pma_bin_search(struct leaf *region, int min_i, int max_i, int value,
     {
         /* now scan left & right to find a non-empty slot */
         l = r = mid;
-        while (empty(region, l) &&
-               empty(region, r) &&
+        while (empty(p, l) &&
+               empty(p, r) &&
                (l > min_i || r < max_i))
         {
             if (l > min_i) l--;
             if (r < max_i) r++;
         }
 
-        if (!empty(region, l))
+        if (!empty(p, l))
             mid = l;
-        else if (!empty(region, r))
+        else if (!empty(p, r))
             mid = r;
         else  /* entire region is empty, insert at current midpoint */
             break;
 
-        if (region[mid].key < value)
+        if (key_at(p, mid) < value)
             min_i = mid + 1;
-        else if (region[mid].key > value)
+        else if (key_at(p, mid) > value)
             max_i = mid - 1;
         else
             break;
@@ -341,43 +963,959 @@ static bool pma_bin_search(struct leaf *region, int min_i, int max_i, int value,
         mid = (min_i + max_i)/2;
     }
     *ins_pt = mid;
-    return region[mid].key == value;
+    return key_at(p, mid) == value;
 }
 
 int pma_predecessor(struct pma *p, key_t key)
 {
-    struct tree_node *parent;
-    struct leaf *start;
-    int pos;
+    int pos, seg;
     int start_ofs;
 
-    parent = veb_tree_find(p->index, key);
+    seg = veb_tree_find_segment(p->index, key);
 
-    start = parent->leaf;
+    /* compressed segments are searched as a whole */
+    if (p->compressed)
+        return seg * p->segsize;
 
-    /* scan the segment starting at parent->leaf for insert pt */
-    start_ofs = start - &p->region[0];
-    pma_bin_search(p->region, start_ofs, start_ofs + p->segsize-1, key, &pos);
+    /* scan the segment the index routed to for insert pt */
+    start_ofs = seg * p->segsize;
+    pma_bin_search(p, start_ofs, start_ofs + p->segsize-1, key, &pos);
 
     return pos;
 }
 
-struct leaf *pma_search(struct pma *p, key_t key)
+/*
+ *  Bring the index up to date after the window of the given height
+ *  around start was rebalanced: only the window's subtree and the
+ *  path above it can have changed.
+ */
+static void update_index(struct pma *p, int start, int height)
 {
-    int pos = pma_predecessor(p, key);
-    return &p->region[pos];
+    int bfs_index = (p->nsegs + start / p->segsize) >> height;
+
+    rebuild_index(p, start, height + 1);
+    for (bfs_index >>= 1; bfs_index >= 1; bfs_index >>= 1)
+        recompute_node(p, bfs_index);
 }
 
-void pma_insert(struct pma *p, key_t key)
+static inline void *old_elem(struct pma *p, int index)
 {
-    int pos = pma_predecessor(p, key);
+    return (char *) p->migration->region + (size_t) index * p->elem_size;
+}
 
-    /* now insert it */
-    pma_insert_at(p, pos, key);
+static inline key_t old_key(struct pma *p, int index)
+{
+    return elem_key(p, old_elem(p, index));
+}
 
-    /* update index */
+/* smallest key in an unmigrated segment, including its pending inserts */
+static key_t old_minimum(struct pma *p, int seg)
+{
+    struct pma_migration *m = p->migration;
+    key_t lo = 0;
+    int i;
 
-    /* TODO: only partial rebuild based on window size... */
-    rebuild_index(p, 0, p->height);
+    if (m->csegs)
+        lo = m->csegs[seg].count ? m->csegs[seg].base : 0;
+    else
+        for (i = seg * m->segsize; i < (seg + 1) * m->segsize && !lo; i++)
+            lo = old_key(p, i);
+
+    for (i = m->pending_head[seg]; i; i = m->pending[i-1].next)
+    {
+        key_t key = elem_key(p, &m->pending[i-1].e);
+
+        if (!lo || key < lo)
+            lo = key;
+    }
+    return lo;
+}
+
+/*
+ *  Move the next old segment, along with anything pending for it,
+ *  to its two new segments.
+ */
+static void migrate_segment(struct pma *p)
+{
+    struct pma_migration *m = p->migration;
+    union pma_elem buf[64];
+    key_t keys[64];
+    int seg = m->next++;
+    int start = 2 * seg * p->segsize;
+    int slots = 2 * p->segsize;
+    int i, k, n = 0;
+
+    if (m->csegs)
+    {
+        n = cseg_decode(&m->csegs[seg], keys);
+        memset(buf, 0, sizeof(buf[0]) * n);
+        for (i=0; i < n; i++)
+            buf[i].leaf.key = keys[i];
+    }
+    else
+        for (i = seg * m->segsize; i < (seg + 1) * m->segsize; i++)
+            if (old_key(p, i))
+                memcpy(&buf[n++], old_elem(p, i), p->elem_size);
+
+    for (i = m->pending_head[seg]; i; i = m->pending[i-1].next)
+    {
+        union pma_elem *e = &m->pending[i-1].e;
+
+        for (k = n; k > 0 && elem_key(p, &buf[k-1]) > elem_key(p, e); k--)
+            buf[k] = buf[k-1];
+        buf[k] = *e;
+        n++;
+    }
+
+    if (m->csegs)
+    {
+        for (i=0; i < n; i++)
+            keys[i] = elem_key(p, &buf[i]);
+        cseg_spread(p, 2 * seg, 2, keys, n);
+
+        free(m->csegs[seg].deltas);
+        memset(&m->csegs[seg], 0, sizeof(m->csegs[seg]));
+    }
+    else
+        for (i=0; i < n; i++)
+            memcpy(elem(p, start + i * slots / n), &buf[i], p->elem_size);
+
+    update_index(p, start, 1);
+}
+
+/*
+ *  Skip over empty old segments and move the frontier up to the
+ *  first key still to be migrated, or finish the grow.
+ */
+static void migrate_advance(struct pma *p)
+{
+    struct pma_migration *m = p->migration;
+    key_t lo;
+
+    while (m->next < m->nsegs)
+    {
+        lo = old_minimum(p, m->next);
+        if (lo)
+        {
+            m->frontier = lo;
+            return;
+        }
+        migrate_segment(p);
+    }
+    grow_finish(p);
+}
+
+static void migrate_step(struct pma *p, int nsegs)
+{
+    struct pma_migration *m = p->migration;
+    int i;
+
+    for (i=0; i < nsegs && m->next < m->nsegs; i++)
+        migrate_segment(p);
+
+    migrate_advance(p);
+}
+
+/*
+ *  Make sure the window of the given height around start holds no
+ *  unmigrated segments before it is measured or rebalanced.
+ */
+static void migrate_window(struct pma *p, int start, int height)
+{
+    struct pma_migration *m = p->migration;
+    int last = (start / p->segsize) | ((1 << height) - 1);
+
+    if (last / 2 < m->next)
+        return;
+
+    while (m->next <= last / 2)
+        migrate_segment(p);
+
+    migrate_advance(p);
+}
+
+/*
+ *  Start doubling the array.  Only the new array and index are
+ *  allocated here, and left for the kernel to zero as they are
+ *  touched; the keys move a few segments at a time as later inserts
+ *  come in, so no single insert pays for the whole copy.
+ */
+static int grow_begin(struct pma *p)
+{
+    struct pma_migration *m = malloc(sizeof(*m));
+    int segsize = max(p->segsize, ilog2(hyperceil(2 * p->size)));
+    int nsegs = 2 * p->nsegs;
+    size_t bytes = p->compressed ? sizeof(*p->csegs) * nsegs :
+                   (size_t) p->elem_size * nsegs * segsize;
+    void *region = zero_alloc(bytes);
+    int *occupied = zero_alloc(sizeof(*occupied) * 2 * nsegs);
+
+    if (m)
+    {
+        memset(m, 0, sizeof(*m));
+        m->max_pending = p->nsegs / PMA_MIGRATE_STEP + 1;
+        m->pending_head = zero_alloc(sizeof(*m->pending_head) * p->nsegs);
+        m->pending = zero_alloc(sizeof(*m->pending) * m->max_pending);
+    }
+    if (!m || !m->pending_head || !m->pending || !region || !occupied)
+    {
+        if (m)
+        {
+            zero_free(m->pending_head, sizeof(*m->pending_head) * p->nsegs);
+            zero_free(m->pending, sizeof(*m->pending) * m->max_pending);
+        }
+        free(m);
+        zero_free(region, bytes);
+        zero_free(occupied, sizeof(*occupied) * 2 * nsegs);
+        return -ENOMEM;
+    }
+
+    m->region = p->region;
+    m->csegs = p->csegs;
+    m->index = p->index;
+    m->size = p->size;
+    m->segsize = p->segsize;
+    m->nsegs = p->nsegs;
+
+    /* the old array is never rebalanced, so it needs no counts */
+    retire(p, p->occupied, sizeof(*p->occupied) * 2 * p->nsegs);
+    p->occupied = occupied;
+
+    p->segsize = segsize;
+    p->nsegs = nsegs;
+    p->size = p->nsegs * p->segsize;
+    p->height++;
+    if (p->compressed)
+        p->csegs = region;
+    else
+        p->region = region;
+    p->index = veb_tree_new(p->nsegs);
+    p->migration = m;
+
+    migrate_advance(p);
+    return 0;
+}
+
+/*
+ *  Drop the old array.  Its mappings are retired rather than unmapped
+ *  here, so that the insert finishing the grow stays cheap.
+ */
+static void grow_finish(struct pma *p)
+{
+    struct pma_migration *m = p->migration;
+    size_t bytes;
+    void *nodes;
+    int i;
+
+    if (m->csegs)
+    {
+        /* migrated segments have already given up their deltas */
+        for (i = m->next; i < m->nsegs; i++)
+            free(m->csegs[i].deltas);
+        retire(p, m->csegs, sizeof(*m->csegs) * m->nsegs);
+    }
+    retire(p, m->region, (size_t) p->elem_size * m->size);
+    nodes = veb_tree_detach(m->index, &bytes);
+    retire(p, nodes, bytes);
+    retire(p, m->pending_head, sizeof(*m->pending_head) * m->nsegs);
+    retire(p, m->pending, sizeof(*m->pending) * m->max_pending);
+    free(m);
+    p->migration = NULL;
+}
+
+/* old segment that key >= frontier belongs in */
+static int old_segment(struct pma *p, key_t key)
+{
+    struct pma_migration *m = p->migration;
+    int seg = veb_tree_find_segment(m->index, key);
+
+    return max(seg, m->next);
+}
+
+/*
+ *  Find key in the unmigrated part of the array, or NULL.
+ */
+static void *old_find(struct pma *p, key_t key)
+{
+    struct pma_migration *m = p->migration;
+    int seg = old_segment(p, key);
+    int i;
+
+    if (m->csegs)
+    {
+        if (cseg_find(&m->csegs[seg], key) >= 0)
+        {
+            p->found.key = key;
+            return &p->found;
+        }
+    }
+    else
+        for (i = seg * m->segsize; i < (seg + 1) * m->segsize; i++)
+            if (old_key(p, i) == key)
+                return old_elem(p, i);
+
+    for (i = m->pending_head[seg]; i; i = m->pending[i-1].next)
+        if (elem_key(p, &m->pending[i-1].e) == key)
+            return &m->pending[i-1].e;
+
+    return NULL;
+}
+
+/*
+ *  Insert into unmigrated segment seg of the old array, shifting
+ *  toward the nearest hole.  Returns -1 if the segment is full.
+ */
+static int old_insert_region(struct pma *p, int seg, const void *e)
+{
+    struct pma_migration *m = p->migration;
+    key_t key = elem_key(p, e);
+    int start = seg * m->segsize;
+    int end = start + m->segsize;
+    int pos, hole;
+
+    for (pos = start; pos < end; pos++)
+        if (old_key(p, pos) > key)
+            break;
+
+    for (hole = pos - 1; hole >= start && old_key(p, hole); hole--)
+        ;
+
+    if (hole >= start)
+    {
+        memmove(old_elem(p, hole), old_elem(p, hole + 1),
+                (size_t) (pos - 1 - hole) * p->elem_size);
+        memcpy(old_elem(p, pos - 1), e, p->elem_size);
+        return 0;
+    }
+
+    for (hole = pos; hole < end && old_key(p, hole); hole++)
+        ;
+
+    if (hole < end)
+    {
+        memmove(old_elem(p, pos + 1), old_elem(p, pos),
+                (size_t) (hole - pos) * p->elem_size);
+        memcpy(old_elem(p, pos), e, p->elem_size);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ *  Insert into an unmigrated segment.  A full segment parks the
+ *  element as pending until it migrates.  Returns -1 if neither
+ *  worked out and the segment was migrated early instead, so the
+ *  caller should insert again.
+ */
+static int old_insert(struct pma *p, const void *e)
+{
+    struct pma_migration *m = p->migration;
+    key_t key = elem_key(p, e);
+    int seg = old_segment(p, key);
+    int ret, i, n;
+
+    if (m->csegs)
+        ret = cseg_insert(&m->csegs[seg], m->segsize, key);
+    else
+        ret = old_insert_region(p, seg, e);
+
+    if (ret == 0)
+    {
+        p->nitems++;
+        return 0;
+    }
+
+    /* the segment plus its pending must fit in two new segments */
+    for (i = m->pending_head[seg], n = 0; i; i = m->pending[i-1].next)
+        n++;
+
+    if (m->npending < m->max_pending && m->segsize + n < 2 * p->segsize)
+    {
+        memcpy(&m->pending[m->npending].e, e, p->elem_size);
+        m->pending[m->npending].next = m->pending_head[seg];
+        m->pending_head[seg] = ++m->npending;
+        p->nitems++;
+        return 0;
+    }
+
+    while (m->next <= seg)
+        migrate_segment(p);
+    migrate_advance(p);
+    return -1;
+}
+
+static int pma_insert_elem(struct pma *p, const void *e)
+{
+    key_t key = elem_key(p, e);
+    int pos, height;
+
+    if (p->retired)
+        release_step(p, PMA_RELEASE_STEP);
+
+    for (;;)
+    {
+        if (p->migration)
+        {
+            migrate_step(p, PMA_MIGRATE_STEP);
+
+            if (p->migration && key >= p->migration->frontier)
+            {
+                if (old_insert(p, e) == 0)
+                    return 0;
+                continue;
+            }
+        }
+
+        pos = pma_predecessor(p, key);
+        height = pma_insert_at(p, pos, e);
+        if (height != -EAGAIN)
+            break;
+    }
+
+    if (height < 0)
+        return height;
+
+    update_index(p, pos, height);
+    return 0;
+}
+
+/*
+ *  Returns the element holding key, or NULL.
+ */
+static void *find_elem(struct pma *p, key_t key)
+{
+    int pos;
+
+    if (p->migration && key >= p->migration->frontier)
+        return old_find(p, key);
+
+    pos = pma_predecessor(p, key);
+    if (key_at(p, pos) != key)
+        return NULL;
+
+    return elem(p, pos);
+}
+
+static struct leaf *search_array(struct pma *p, key_t key)
+{
+    void *e;
+    int pos;
+
+    if (p->migration && key >= p->migration->frontier)
+    {
+        e = old_find(p, key);
+        if (e && p->vlog)
+        {
+            p->found.key = key;
+            return &p->found;
+        }
+        return e;
+    }
+
+    pos = pma_predecessor(p, key);
+
+    if (p->compressed)
+    {
+        if (cseg_find(&p->csegs[pos / p->segsize], key) < 0)
+            return NULL;
+
+        p->found.key = key;
+        return &p->found;
+    }
+
+    if (p->vlog)
+    {
+        if (key_at(p, pos) != key)
+            return NULL;
+
+        p->found.key = key;
+        return &p->found;
+    }
+    return elem(p, pos);
 }
 
+/* both element types start with the key */
+static int elem_cmp(const void *a, const void *b)
+{
+    key_t ka = *(const key_t *) a;
+    key_t kb = *(const key_t *) b;
+
+    return (ka > kb) - (ka < kb);
+}
+
+/*
+ *  Background rebalancer: take everything in the backlog and insert
+ *  it in key order, so inserts bound for the same segment are applied
+ *  together.  The array lock is dropped every PMA_BATCH_STEP inserts
+ *  so searches don't wait for the whole batch; they look through the
+ *  part of the batch not yet applied, so a key is never in neither
+ *  the backlog, the batch nor the array.
+ */
+static void *pma_rebalancer(void *arg)
+{
+    struct pma *p = arg;
+    struct pma_deferred *d = p->deferred;
+    int i, n;
+
+    pthread_mutex_lock(&d->qlock);
+    for (;;)
+    {
+        while (!d->len && !d->stop)
+            pthread_cond_wait(&d->work, &d->qlock);
+
+        if (!d->len)
+            break;
+        pthread_mutex_unlock(&d->qlock);
+
+        pthread_rwlock_wrlock(&d->lock);
+        pthread_mutex_lock(&d->qlock);
+
+        for (n = 0; n < d->len; n++)
+            d->batch[n] = d->backlog[(d->head + n) % PMA_BACKLOG];
+        d->head = (d->head + n) % PMA_BACKLOG;
+        d->len = 0;
+        d->busy = 1;
+        pthread_cond_broadcast(&d->room);
+        pthread_mutex_unlock(&d->qlock);
+
+        qsort(d->batch, n, sizeof(d->batch[0]), elem_cmp);
+        d->nbatch = n;
+        for (i=0; i < n; i++)
+        {
+            pma_insert_elem(p, &d->batch[i]);
+            d->applied = i + 1;
+            if (d->applied % PMA_BATCH_STEP == 0)
+            {
+                pthread_rwlock_unlock(&d->lock);
+                pthread_rwlock_wrlock(&d->lock);
+            }
+        }
+        d->nbatch = d->applied = 0;
+
+        pthread_rwlock_unlock(&d->lock);
+
+        pthread_mutex_lock(&d->qlock);
+        d->busy = 0;
+        pthread_cond_broadcast(&d->room);
+    }
+    pthread_mutex_unlock(&d->qlock);
+    return NULL;
+}
+
+/*
+ *  Insert without waiting on a rebalance.  If the array is free and
+ *  the target segment has room, the element goes straight in;
+ *  otherwise it is parked in the backlog for the rebalancer.  A full
+ *  backlog blocks the caller until the rebalancer catches up.
+ */
+static void pma_insert_deferred(struct pma *p, const void *e)
+{
+    struct pma_deferred *d = p->deferred;
+    int occupation, pos;
+
+    if (pthread_rwlock_trywrlock(&d->lock) == 0)
+    {
+        pos = pma_predecessor(p, elem_key(p, e));
+        if (!p->migration &&
+            density(p, pos, 0, &occupation) <= target_density(p, 0) &&
+            rebalance_insert(p, pos, 0, occupation, e) == 0)
+        {
+            update_index(p, pos, 0);
+            pthread_rwlock_unlock(&d->lock);
+            return;
+        }
+        pthread_rwlock_unlock(&d->lock);
+    }
+
+    pthread_mutex_lock(&d->qlock);
+    while (d->len == PMA_BACKLOG)
+        pthread_cond_wait(&d->room, &d->qlock);
+
+    memcpy(&d->backlog[(d->head + d->len) % PMA_BACKLOG], e, p->elem_size);
+    d->len++;
+    pthread_cond_signal(&d->work);
+    pthread_mutex_unlock(&d->qlock);
+}
+
+/*
+ *  Hand rebalancing off to a background thread.  Afterwards
+ *  pma_insert() only touches a single segment, and inserts that would
+ *  need a larger window are queued instead.  One thread may insert
+ *  and search; other calls flush the backlog first.
+ */
+void pma_start_deferred(struct pma *p)
+{
+    struct pma_deferred *d = malloc(sizeof(*d));
+
+    memset(d, 0, sizeof(*d));
+    pthread_rwlock_init(&d->lock, NULL);
+    pthread_mutex_init(&d->qlock, NULL);
+    pthread_cond_init(&d->work, NULL);
+    pthread_cond_init(&d->room, NULL);
+
+    p->deferred = d;
+    pthread_create(&d->worker, NULL, pma_rebalancer, p);
+}
+
+/*
+ *  Wait until every queued insert is in the array.
+ */
+void pma_flush(struct pma *p)
+{
+    struct pma_deferred *d = p->deferred;
+
+    if (!d)
+        return;
+
+    pthread_mutex_lock(&d->qlock);
+    while (d->len || d->busy)
+        pthread_cond_wait(&d->room, &d->qlock);
+    pthread_mutex_unlock(&d->qlock);
+}
+
+static void pma_stop_deferred(struct pma *p)
+{
+    struct pma_deferred *d = p->deferred;
+
+    pthread_mutex_lock(&d->qlock);
+    d->stop = 1;
+    pthread_cond_signal(&d->work);
+    pthread_mutex_unlock(&d->qlock);
+    pthread_join(d->worker, NULL);
+
+    pthread_rwlock_destroy(&d->lock);
+    pthread_mutex_destroy(&d->qlock);
+    pthread_cond_destroy(&d->work);
+    pthread_cond_destroy(&d->room);
+    free(d);
+    p->deferred = NULL;
+}
+
+/* copy a queued element into p->found */
+static struct leaf *found_pending(struct pma *p, union pma_elem *e)
+{
+    p->found.key = elem_key(p, e);
+    if (!p->vlog)
+        p->found = e->leaf;
+    return &p->found;
+}
+
+/*
+ *  Search the array, then the rest of the batch being applied, then
+ *  the backlog.  The result is copied into p->found, since the
+ *  rebalancer may move the element as soon as the lock is dropped.
+ */
+static struct leaf *pma_search_deferred(struct pma *p, key_t key)
+{
+    struct pma_deferred *d = p->deferred;
+    struct leaf *found;
+    int i;
+
+    pthread_rwlock_rdlock(&d->lock);
+
+    /* in plain mode the array returns the slot it routed to */
+    found = search_array(p, key);
+    if (found && found->key != key)
+        found = NULL;
+    if (found && found != &p->found)
+        p->found = *found;
+
+    for (i = d->applied; !found && i < d->nbatch; i++)
+        if (elem_key(p, &d->batch[i]) == key)
+            found = found_pending(p, &d->batch[i]);
+
+    if (!found)
+    {
+        pthread_mutex_lock(&d->qlock);
+        for (i=0; i < d->len; i++)
+        {
+            union pma_elem *e = &d->backlog[(d->head + i) % PMA_BACKLOG];
+
+            if (elem_key(p, e) == key)
+            {
+                found = found_pending(p, e);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&d->qlock);
+    }
+
+    pthread_rwlock_unlock(&d->lock);
+    return found ? &p->found : NULL;
+}
+
+struct leaf *pma_search(struct pma *p, key_t key)
+{
+    if (p->deferred)
+        return pma_search_deferred(p, key);
+
+    return search_array(p, key);
+}
+
+int pma_insert(struct pma *p, key_t key)
+{
+    union pma_elem e;
+
+    memset(&e, 0, sizeof(e));
+    if (p->vlog)
+        e.vleaf.key = key;
+    else
+        e.leaf.key = key;
+
+    if (p->deferred)
+    {
+        pma_insert_deferred(p, &e);
+        return 0;
+    }
+    return pma_insert_elem(p, &e);
+}
+
+/* move the value of v, if it has one, to log */
+static void compact_value(struct pma *p, struct vlog *log, struct vleaf *v)
+{
+    void *value;
+    u32 len;
+
+    if (!v->key || !v->handle)
+        return;
+
+    value = vlog_get(p->vlog, v->handle, &len);
+    v->handle = vlog_append(log, v->key, value, len);
+}
+
+/*
+ *  Copy the live values into a fresh log and drop the old one.  A
+ *  grow in progress is left alone: the old array's unmigrated part
+ *  and its pending inserts are walked as well.
+ */
+void pma_compact_values(struct pma *p)
+{
+    struct pma_migration *m;
+    struct vlog *log;
+    int i, j, end;
+
+    pma_flush(p);
+    log = vlog_begin_compact(p->vlog);
+
+    m = p->migration;
+    end = m ? 2 * m->next * p->segsize : p->size;
+    for (i=0; i < end; i++)
+        compact_value(p, log, elem(p, i));
+
+    if (m)
+    {
+        for (i = m->next * m->segsize; i < m->size; i++)
+            compact_value(p, log, old_elem(p, i));
+
+        for (i = m->next; i < m->nsegs; i++)
+            for (j = m->pending_head[i]; j; j = m->pending[j-1].next)
+                compact_value(p, log, &m->pending[j-1].e.vleaf);
+    }
+    p->vlog = vlog_end_compact(p->vlog, log);
+}
+
+/*
+ *  Insert key with a value, or replace the value if the key is
+ *  already present.  Without a value log, values are limited to the
+ *  inline size of struct leaf; returns -1 if it doesn't fit, or
+ *  -ENOMEM.
+ */
+int pma_insert_value(struct pma *p, key_t key, const void *value, u32 len)
+{
+    union pma_elem e;
+    struct vleaf *v;
+
+    memset(&e, 0, sizeof(e));
+    pma_flush(p);
+
+    if (!p->vlog)
+    {
+        struct leaf *l;
+
+        if (p->compressed || len > sizeof(e.leaf.value))
+            return -1;
+
+        l = find_elem(p, key);
+        if (l)
+        {
+            memcpy(l->value, value, len);
+            return 0;
+        }
+
+        e.leaf.key = key;
+        memcpy(e.leaf.value, value, len);
+        return pma_insert_elem(p, &e);
+    }
+
+    v = find_elem(p, key);
+    if (v)
+    {
+        vlog_release(p->vlog, v->handle);
+        v->handle = vlog_append(p->vlog, key, value, len);
+        v->len = len;
+
+        /* compact once most of the log is garbage */
+        if (p->vlog->dead > p->vlog->live &&
+            p->vlog->dead > VLOG_COMPACT_MIN)
+            pma_compact_values(p);
+        return 0;
+    }
+
+    e.vleaf.key = key;
+    e.vleaf.len = len;
+    e.vleaf.handle = vlog_append(p->vlog, key, value, len);
+    return pma_insert_elem(p, &e);
+}
+
+/*
+ *  Returns the value stored with key, or NULL if key is not present.
+ */
+void *pma_get_value(struct pma *p, key_t key, u32 *len)
+{
+    void *e;
+
+    if (p->compressed)
+        return NULL;
+
+    pma_flush(p);
+    e = find_elem(p, key);
+    if (!e)
+        return NULL;
+
+    if (p->vlog)
+    {
+        struct vleaf *v = e;
+
+        if (!v->handle)
+            return NULL;
+        return vlog_get(p->vlog, v->handle, len);
+    }
+
+    *len = sizeof(((struct leaf *) 0)->value);
+    return ((struct leaf *) e)->value;
+}
+
+
+/*
+ *  Copy the keys of a segment, in order, into keys.
+ */
+static int segment_keys(struct pma *p, int seg, key_t *keys)
+{
+    int i, n = 0;
+
+    if (p->compressed)
+        return cseg_decode(&p->csegs[seg], keys);
+
+    for (i = seg * p->segsize; i < (seg + 1) * p->segsize; i++)
+        if (!empty(p, i))
+            keys[n++] = key_at(p, i);
+
+    return n;
+}
+
+/*
+ *  Copy the keys of unmigrated old segment seg, along with those
+ *  pending for it, in order, into keys.
+ */
+static int old_segment_keys(struct pma *p, int seg, key_t *keys)
+{
+    struct pma_migration *m = p->migration;
+    int i, k, n = 0;
+
+    if (m->csegs)
+        n = cseg_decode(&m->csegs[seg], keys);
+    else
+        for (i = seg * m->segsize; i < (seg + 1) * m->segsize; i++)
+            if (old_key(p, i))
+                keys[n++] = old_key(p, i);
+
+    for (i = m->pending_head[seg]; i; i = m->pending[i-1].next)
+    {
+        key_t key = elem_key(p, &m->pending[i-1].e);
+
+        for (k = n; k > 0 && keys[k-1] > key; k--)
+            keys[k] = keys[k-1];
+        keys[k] = key;
+        n++;
+    }
+    return n;
+}
+
+/*
+ *  Call fn on each of the n sorted keys that is in [lo, hi].
+ *  Returns false once a key is past hi.
+ */
+static bool visit_keys(const key_t *keys, int n, key_t lo, key_t hi,
+                       void (*fn)(key_t key, void *arg), void *arg,
+                       int *count)
+{
+    int i;
+
+    for (i=0; i < n; i++)
+    {
+        if (keys[i] > hi)
+            return false;
+
+        if (keys[i] >= lo)
+        {
+            fn(keys[i], arg);
+            (*count)++;
+        }
+    }
+    return true;
+}
+
+/*
+ *  Call fn on every key in [lo, hi], in order.  Returns the number
+ *  of keys visited.  During a grow, keys below the frontier are in
+ *  the migrated part of the new array and the rest in the old one.
+ */
+int pma_range(struct pma *p, key_t lo, key_t hi,
+              void (*fn)(key_t key, void *arg), void *arg)
+{
+    struct pma_migration *m;
+    key_t keys[64];
+    int seg, n, end;
+    int count = 0;
+
+    pma_flush(p);
+    m = p->migration;
+    end = m ? 2 * m->next : p->nsegs;
+    seg = pma_predecessor(p, lo) / p->segsize;
+
+    /* the index only gets us close; back up past anything >= lo */
+    while (seg > 0)
+    {
+        n = segment_keys(p, seg - 1, keys);
+        if (n && keys[n-1] < lo)
+            break;
+        seg--;
+    }
+
+    for (; seg < end; seg++)
+    {
+        n = segment_keys(p, seg, keys);
+        if (!visit_keys(keys, n, lo, hi, fn, arg, &count))
+            return count;
+    }
+
+    if (!m)
+        return count;
+
+    seg = lo >= m->frontier ? old_segment(p, lo) : m->next;
+    while (seg > m->next)
+    {
+        n = old_segment_keys(p, seg - 1, keys);
+        if (n && keys[n-1] < lo)
+            break;
+        seg--;
+    }
+
+    for (; seg < m->nsegs; seg++)
+    {
+        n = old_segment_keys(p, seg, keys);
+        if (!visit_keys(keys, n, lo, hi, fn, arg, &count))
+            return count;
+    }
+    return count;
+}
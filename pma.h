@@ -1,8 +1,19 @@
 #ifndef PMA_H
 #define PMA_H
+#include <stddef.h>
 struct pma *pma_new(int initial_size);
+struct pma *pma_new_compressed(int initial_size);
+struct pma *pma_new_vlog(int initial_size, const char *path);
+size_t pma_memory_usage(struct pma *p);
 void pma_print(struct pma *p);
 int pma_insert(struct pma *p, key_t key);
 struct leaf *pma_search(struct pma *p, key_t key);
+int pma_insert_value(struct pma *p, key_t key, const void *value, u32 len);
+void *pma_get_value(struct pma *p, key_t key, u32 *len);
+void pma_compact_values(struct pma *p);
+int pma_range(struct pma *p, key_t lo, key_t hi,
+              void (*fn)(key_t key, void *arg), void *arg);
+void pma_start_deferred(struct pma *p);
+void pma_flush(struct pma *p);
 void pma_free(struct pma *p);
 #endif
@@ -0,0 +1,408 @@
+/* key-range sharding over multiple PMAs */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include "types.h"
+#include "pma.h"
+#include "shard.h"
+
+/*
+ *  A single PMA serializes every insert behind one rebalance, and one
+ *  pma_grow() stalls everything.  The router spreads the key space
+ *  over several PMAs, each owned by a worker thread that drains a
+ *  queue of inserts, so rebalances and grows in different shards run
+ *  in parallel.
+ *
+ *  The top level is just a sorted array of separator keys.  When one
+ *  shard holds much more than its share of the keys, it is split in
+ *  two at its median key.  Shards cover disjoint, ordered key ranges,
+ *  so a range scan that crosses shards visits them left to right and
+ *  the results come out in order.
+ *
+ *  Lock order is split_lock, then map_lock, then a shard's lock, then
+ *  its qlock.  The workers never take map_lock.
+ */
+
+#define SHARD_BATCH 64
+#define SPLIT_FACTOR 4          /* split at this multiple of the others' mean */
+#define SPLIT_MIN 4096          /* but never below this many keys */
+
+/*
+ *  Remember keys applied to a shard whose split is being built, so
+ *  they can be carried over to the new PMAs.
+ */
+static void split_log_add(struct shard *s, key_t *keys, int n)
+{
+    if (s->split_len + n > s->split_cap)
+    {
+        s->split_cap = max(s->split_len + n, 2 * s->split_cap);
+        s->split_log = realloc(s->split_log,
+                               sizeof(*s->split_log) * s->split_cap);
+    }
+    memcpy(&s->split_log[s->split_len], keys, sizeof(*keys) * n);
+    s->split_len += n;
+}
+
+static void *shard_worker(void *arg)
+{
+    struct shard *s = arg;
+    key_t batch[SHARD_BATCH];
+    int i, n;
+
+    pthread_mutex_lock(&s->qlock);
+    for (;;)
+    {
+        while (!s->len && !s->stop)
+            pthread_cond_wait(&s->wake, &s->qlock);
+
+        if (!s->len)
+            break;
+
+        for (n=0; n < SHARD_BATCH && s->len; n++)
+        {
+            batch[n] = s->queue[s->head];
+            s->head = (s->head + 1) % SHARD_QUEUE;
+            s->len--;
+        }
+        s->busy = true;
+        pthread_cond_broadcast(&s->idle);
+        pthread_mutex_unlock(&s->qlock);
+
+        pthread_mutex_lock(&s->lock);
+        for (i=0; i < n; i++)
+            pma_insert(s->pma, batch[i]);
+        if (s->splitting)
+            split_log_add(s, batch, n);
+        pthread_mutex_unlock(&s->lock);
+
+        pthread_mutex_lock(&s->qlock);
+        s->busy = false;
+        if (!s->len)
+            pthread_cond_broadcast(&s->idle);
+    }
+    pthread_mutex_unlock(&s->qlock);
+    return NULL;
+}
+
+static struct shard *shard_new(struct pma *pma)
+{
+    struct shard *s = malloc(sizeof(*s));
+
+    memset(s, 0, sizeof(*s));
+    s->pma = pma;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->qlock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_cond_init(&s->idle, NULL);
+
+    if (pthread_create(&s->worker, NULL, shard_worker, s))
+    {
+        perror("pthread_create");
+        exit(-1);
+    }
+    return s;
+}
+
+/*
+ *  Wait until every insert queued so far has been applied.
+ */
+static void shard_flush(struct shard *s)
+{
+    pthread_mutex_lock(&s->qlock);
+    while (s->len || s->busy)
+        pthread_cond_wait(&s->idle, &s->qlock);
+    pthread_mutex_unlock(&s->qlock);
+}
+
+static void shard_free(struct shard *s)
+{
+    pthread_mutex_lock(&s->qlock);
+    s->stop = true;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->qlock);
+
+    pthread_join(s->worker, NULL);
+    pma_free(s->pma);
+    free(s->split_log);
+    free(s);
+}
+
+/*
+ *  Create a router with nshards shards splitting [lo, hi] evenly.
+ *  Shards are split as the key distribution requires, up to
+ *  max_shards.
+ */
+struct router *router_new(int nshards, int max_shards, int initial_size,
+                          key_t lo, key_t hi)
+{
+    struct router *r = malloc(sizeof(*r));
+    int i;
+
+    assert(nshards > 0 && nshards <= max_shards);
+
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_init(&r->split_lock, NULL);
+    pthread_rwlock_init(&r->map_lock, NULL);
+    r->nshards = nshards;
+    r->max_shards = max_shards;
+    r->initial_size = initial_size;
+    r->separators = malloc(sizeof(*r->separators) * max_shards);
+    r->shards = malloc(sizeof(*r->shards) * max_shards);
+
+    for (i=0; i < nshards; i++)
+    {
+        r->separators[i] = lo + (key_t) (((long long) hi - lo) * i / nshards);
+        r->shards[i] = shard_new(pma_new(initial_size));
+    }
+    return r;
+}
+
+/* Returns the shard whose range holds key. */
+static int route(struct router *r, key_t key)
+{
+    int lo = 0, hi = r->nshards - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (r->separators[mid] <= key)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+struct key_array {
+    key_t *keys;
+    int n;
+};
+
+static void collect_key(key_t key, void *arg)
+{
+    struct key_array *a = arg;
+    a->keys[a->n++] = key;
+}
+
+/*
+ *  Split the shard holding key at its median key.
+ *
+ *  The shard's keys are read out and the two new PMAs built from the
+ *  sorted halves without map_lock, while the shard keeps taking
+ *  inserts; its worker logs the keys it applies meanwhile.  Only
+ *  carrying those over and swapping the map entries is done under
+ *  the write lock.
+ */
+static void router_split(struct router *r, key_t key)
+{
+    struct shard *s, *upper;
+    struct key_array a;
+    struct pma *left, *right, *old;
+    key_t median;
+    int i, j, mid, nleft;
+
+    pthread_mutex_lock(&r->split_lock);
+
+    /* splits are serialized, so s stays at i until we change the map */
+    pthread_rwlock_rdlock(&r->map_lock);
+    i = route(r, key);
+    s = r->shards[i];
+    if (r->nshards == r->max_shards)
+    {
+        pthread_rwlock_unlock(&r->map_lock);
+        goto out;
+    }
+    pthread_rwlock_unlock(&r->map_lock);
+
+    shard_flush(s);
+
+    pthread_mutex_lock(&s->lock);
+    a.keys = malloc(sizeof(*a.keys) * (s->pma->nitems + 1));
+    a.n = 0;
+    pma_range(s->pma, INT_MIN, INT_MAX, collect_key, &a);
+    s->splitting = true;
+    s->split_len = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    /*
+     *  All keys in the upper shard must be >= the separator.  If the
+     *  lower half is all one key, split above it instead; if the
+     *  whole shard is, it can't be split until it has doubled.
+     */
+    mid = a.n / 2;
+    median = a.keys[mid];
+    while (mid > 0 && a.keys[mid-1] == median)
+        mid--;
+    if (mid == 0)
+    {
+        while (mid < a.n && a.keys[mid] == median)
+            mid++;
+        if (mid < a.n)
+            median = a.keys[mid];
+    }
+
+    if (mid == a.n)
+    {
+        pthread_mutex_lock(&s->lock);
+        s->splitting = false;
+        __atomic_store_n(&s->split_at, 2 * a.n, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s->lock);
+        free(a.keys);
+        goto out;
+    }
+
+    left = pma_new(r->initial_size);
+    right = pma_new(r->initial_size);
+    for (j=0; j < mid; j++)
+        pma_insert(left, a.keys[j]);
+    for (; j < a.n; j++)
+        pma_insert(right, a.keys[j]);
+    free(a.keys);
+
+    pthread_rwlock_wrlock(&r->map_lock);
+
+    /* no new inserts can be queued now; apply the ones that were */
+    shard_flush(s);
+
+    pthread_mutex_lock(&s->lock);
+    nleft = mid;
+    for (j=0; j < s->split_len; j++)
+    {
+        if (s->split_log[j] < median)
+        {
+            pma_insert(left, s->split_log[j]);
+            nleft++;
+        }
+        else
+            pma_insert(right, s->split_log[j]);
+    }
+    s->splitting = false;
+
+    old = s->pma;
+    s->pma = left;
+    __atomic_store_n(&s->count, nleft, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->split_at, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+
+    upper = shard_new(right);
+    upper->count = a.n + s->split_len - nleft;
+
+    memmove(&r->separators[i+2], &r->separators[i+1],
+            sizeof(*r->separators) * (r->nshards - i - 1));
+    memmove(&r->shards[i+2], &r->shards[i+1],
+            sizeof(*r->shards) * (r->nshards - i - 1));
+    r->separators[i+1] = median;
+    r->shards[i+1] = upper;
+    r->nshards++;
+    pthread_rwlock_unlock(&r->map_lock);
+
+    pma_free(old);
+out:
+    pthread_mutex_unlock(&r->split_lock);
+}
+
+/*
+ *  Queue key for insertion into its shard.  Blocks while the shard's
+ *  queue is full.
+ */
+void router_insert(struct router *r, key_t key)
+{
+    struct shard *s;
+    int i, count, total = 0;
+    bool split = false;
+
+    pthread_rwlock_rdlock(&r->map_lock);
+    i = route(r, key);
+    s = r->shards[i];
+
+    pthread_mutex_lock(&s->qlock);
+    while (s->len == SHARD_QUEUE)
+        pthread_cond_wait(&s->idle, &s->qlock);
+
+    s->queue[(s->head + s->len) % SHARD_QUEUE] = key;
+    s->len++;
+    count = __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->qlock);
+
+    /* is this shard growing much faster than the others? */
+    if (count > SPLIT_MIN && r->nshards < r->max_shards &&
+        count >= __atomic_load_n(&s->split_at, __ATOMIC_RELAXED))
+    {
+        for (i=0; i < r->nshards; i++)
+            total += __atomic_load_n(&r->shards[i]->count, __ATOMIC_RELAXED);
+
+        split = r->nshards == 1 ||
+            count > SPLIT_FACTOR * ((total - count) / (r->nshards - 1));
+    }
+    pthread_rwlock_unlock(&r->map_lock);
+
+    /* the shard may have moved by then, so it is found by key again */
+    if (split)
+        router_split(r, key);
+}
+
+/*
+ *  Look up key, copying the item into result if it is found.  Sees
+ *  every insert made before the call.
+ */
+bool router_search(struct router *r, key_t key, struct leaf *result)
+{
+    struct shard *s;
+    struct leaf *leaf;
+    bool found = false;
+
+    pthread_rwlock_rdlock(&r->map_lock);
+    s = r->shards[route(r, key)];
+    shard_flush(s);
+
+    pthread_mutex_lock(&s->lock);
+    leaf = pma_search(s->pma, key);
+    if (leaf && leaf->key == key)
+    {
+        *result = *leaf;
+        found = true;
+    }
+    pthread_mutex_unlock(&s->lock);
+    pthread_rwlock_unlock(&r->map_lock);
+    return found;
+}
+
+/*
+ *  Call fn on every key in [lo, hi], in order, across all shards.
+ */
+int router_range(struct router *r, key_t lo, key_t hi,
+                 void (*fn)(key_t key, void *arg), void *arg)
+{
+    struct shard *s;
+    int i, count = 0;
+
+    pthread_rwlock_rdlock(&r->map_lock);
+    for (i = route(r, lo); i < r->nshards && r->separators[i] <= hi; i++)
+    {
+        s = r->shards[i];
+        shard_flush(s);
+
+        pthread_mutex_lock(&s->lock);
+        count += pma_range(s->pma, lo, hi, fn, arg);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_rwlock_unlock(&r->map_lock);
+    return count;
+}
+
+void router_free(struct router *r)
+{
+    int i;
+
+    for (i=0; i < r->nshards; i++)
+        shard_free(r->shards[i]);
+
+    pthread_rwlock_destroy(&r->map_lock);
+    pthread_mutex_destroy(&r->split_lock);
+    free(r->separators);
+    free(r->shards);
+    free(r);
+}
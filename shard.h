@@ -0,0 +1,59 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "types.h"
+
+#define SHARD_QUEUE 1024        /* pending inserts per shard */
+
+/*
+ *  One PMA, owned by a worker thread that applies the inserts
+ *  queued for it.
+ */
+struct shard {
+    struct pma *pma;
+    pthread_t worker;
+    int count;                  /* keys routed here so far */
+    int split_at;               /* count to retry a failed split at */
+
+    pthread_mutex_t lock;       /* protects pma and the split log */
+
+    /* keys applied while a split is being built, see router_split() */
+    bool splitting;
+    key_t *split_log;
+    int split_len;
+    int split_cap;
+
+    pthread_mutex_t qlock;      /* protects the fields below */
+    pthread_cond_t wake;        /* work for the worker */
+    pthread_cond_t idle;        /* room in the queue, or queue drained */
+    key_t queue[SHARD_QUEUE];
+    int head;
+    int len;
+    bool busy;                  /* worker is applying a batch */
+    bool stop;
+};
+
+/*
+ *  Partitions the key space over a set of shards.  Shard i holds the
+ *  keys in [separators[i], separators[i+1]).
+ */
+struct router {
+    pthread_mutex_t split_lock; /* one split at a time */
+    pthread_rwlock_t map_lock;  /* protects separators and shards */
+    int nshards;
+    int max_shards;
+    int initial_size;
+    key_t *separators;
+    struct shard **shards;
+};
+
+struct router *router_new(int nshards, int max_shards, int initial_size,
+                          key_t lo, key_t hi);
+void router_insert(struct router *r, key_t key);
+bool router_search(struct router *r, key_t key, struct leaf *result);
+int router_range(struct router *r, key_t lo, key_t hi,
+                 void (*fn)(key_t key, void *arg), void *arg);
+void router_free(struct router *r);
+#endif
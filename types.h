@@ -16,6 +16,13 @@ struct leaf {
     char value[10];
 };
 
+/* An item whose value is held out of line in a value log */
+struct vleaf {
+    key_t key;
+    u32 len;
+    u64 handle;
+};
+
 /* Binary tree that indexes segments in the PMA */
 struct tree_node {
     key_t key;
@@ -30,6 +37,18 @@ struct veb {
     struct tree_node *elements;
 };
 
+/*
+ * A PMA segment in compressed form: the keys are stored as
+ * fixed-width deltas from the smallest key in the segment.
+ */
+struct pma_cseg {
+    key_t base;         /* first (smallest) key */
+    u8 width;           /* bytes per delta: 0, 1, 2 or 4 */
+    u8 count;           /* number of keys in the segment */
+    u16 cap;            /* allocated size of deltas, in bytes */
+    u8 *deltas;
+};
+
 /* Packed Memory Array */
 struct pma {
     /* thresholds for density at lowest level */
@@ -40,15 +59,36 @@ struct pma {
     double max_density;
     double min_density;
 
-    struct leaf *region;        /* allocated array */
+    void *region;       /* allocated array of struct leaf or vleaf */
+    int elem_size;      /* size of an element of region */
     int size;           /* total size of array */
     int segsize;        /* size of a segment */
     int nsegs;          /* number of segments */
     int height;         /* height of the implicit tree */
     int nitems;         /* total number of items */
 
+    /* segments stored compressed in csegs instead of in region */
+    int compressed;
+    struct pma_cseg *csegs;
+    struct leaf found;  /* search result in compressed mode */
+    key_t *scratch;     /* keys of a window being rewritten */
+    int scratch_cap;
+
+    /* values held in a value log, region holds struct vleaf */
+    struct vlog *vlog;
+
+    /* old array while a grow is in progress */
+    struct pma_migration *migration;
+    struct pma_retired *retired;    /* and after, until unmapped */
+
+    /* rebalancing handed off to a background thread */
+    struct pma_deferred *deferred;
+
     /* index structure (array in veb layout) */
     struct veb *index;
+
+    /* keys under each index node, by bfs number */
+    int *occupied;
 };
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
@@ -0,0 +1,202 @@
+/* out-of-line value log */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "valuelog.h"
+
+/*
+ *  Large values don't belong in the packed memory array: every
+ *  rebalance would have to move them.  Instead the PMA stores a key
+ *  and a handle, and the values themselves are appended to this log.
+ *
+ *  The log is either an anonymous arena or a file, mapped in either
+ *  case and doubled with mremap() as it fills up.  Values are never
+ *  overwritten; replacing one releases the old record, and once
+ *  enough of the log is dead the owner copies the live records into
+ *  a fresh log (see pma_compact_values()).
+ */
+
+#define VLOG_INITIAL_SIZE (1 << 20)
+
+/* Each value is preceded by a record header, 8-byte aligned */
+struct vlog_record {
+    key_t key;
+    u32 len;
+    char data[];
+};
+
+static u64 record_size(u32 len)
+{
+    return (sizeof(struct vlog_record) + len + 7) & ~7ULL;
+}
+
+static void vlog_resize(struct vlog *log, u64 new_size)
+{
+    void *ptr;
+
+    if (log->fd >= 0 && ftruncate(log->fd, new_size) < 0)
+    {
+        perror("ftruncate");
+        exit(-1);
+    }
+
+    ptr = mremap(log->base, log->size, new_size, MREMAP_MAYMOVE);
+    if (ptr == MAP_FAILED)
+    {
+        perror("mremap");
+        exit(-1);
+    }
+    log->base = ptr;
+    log->size = new_size;
+}
+
+/*
+ *  Create an empty log.  With a NULL path the values live in
+ *  anonymous memory, otherwise in the named file (truncated).
+ */
+struct vlog *vlog_new(const char *path)
+{
+    struct vlog *log = malloc(sizeof(*log));
+    int flags = MAP_SHARED;
+
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+
+    if (path)
+    {
+        log->path = strdup(path);
+        log->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (log->fd < 0)
+        {
+            perror("open");
+            exit(-1);
+        }
+        if (ftruncate(log->fd, VLOG_INITIAL_SIZE) < 0)
+        {
+            perror("ftruncate");
+            exit(-1);
+        }
+    }
+    else
+        flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    log->size = VLOG_INITIAL_SIZE;
+    log->base = mmap(NULL, log->size, PROT_READ | PROT_WRITE, flags,
+                     log->fd, 0);
+    if (log->base == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(-1);
+    }
+
+    /* offset 0 is never handed out so a zero handle means "no value" */
+    log->tail = 8;
+    return log;
+}
+
+u64 vlog_append(struct vlog *log, key_t key, const void *value, u32 len)
+{
+    u64 size = record_size(len);
+    u64 handle = log->tail;
+    u64 new_size = log->size;
+    struct vlog_record *rec;
+
+    while (log->tail + size > new_size)
+        new_size *= 2;
+
+    if (new_size != log->size)
+        vlog_resize(log, new_size);
+
+    rec = (struct vlog_record *) (log->base + handle);
+    rec->key = key;
+    rec->len = len;
+    memcpy(rec->data, value, len);
+
+    log->tail += size;
+    log->live += size;
+    return handle;
+}
+
+void *vlog_get(struct vlog *log, u64 handle, u32 *len)
+{
+    struct vlog_record *rec;
+
+    assert(handle && handle < log->tail);
+
+    rec = (struct vlog_record *) (log->base + handle);
+    *len = rec->len;
+    return rec->data;
+}
+
+/*
+ *  Note that the record at handle is no longer referenced.
+ */
+void vlog_release(struct vlog *log, u64 handle)
+{
+    struct vlog_record *rec;
+    u64 size;
+
+    if (!handle)
+        return;
+
+    rec = (struct vlog_record *) (log->base + handle);
+    size = record_size(rec->len);
+
+    log->live -= size;
+    log->dead += size;
+}
+
+/*
+ *  Start a compaction: returns an empty log of the same kind for the
+ *  caller to append the live records to.
+ */
+struct vlog *vlog_begin_compact(struct vlog *log)
+{
+    char *path = NULL;
+    struct vlog *new_log;
+
+    if (log->path)
+    {
+        path = malloc(strlen(log->path) + sizeof(".compact"));
+        sprintf(path, "%s.compact", log->path);
+    }
+
+    new_log = vlog_new(path);
+    free(path);
+    return new_log;
+}
+
+/*
+ *  Finish a compaction: new_log takes the place (and file name) of
+ *  log, which is freed.
+ */
+struct vlog *vlog_end_compact(struct vlog *log, struct vlog *new_log)
+{
+    if (log->path)
+    {
+        if (rename(new_log->path, log->path) < 0)
+        {
+            perror("rename");
+            exit(-1);
+        }
+        free(new_log->path);
+        new_log->path = log->path;
+        log->path = NULL;
+    }
+    vlog_free(log);
+    return new_log;
+}
+
+void vlog_free(struct vlog *log)
+{
+    munmap(log->base, log->size);
+    if (log->fd >= 0)
+        close(log->fd);
+    free(log->path);
+    free(log);
+}
@@ -0,0 +1,27 @@
+#ifndef VALUELOG_H
+#define VALUELOG_H
+
+#include "types.h"
+
+/*
+ *  Append-only log of values.  A value is referred to by the handle
+ *  returned from vlog_append(), which is its byte offset in the log.
+ */
+struct vlog {
+    int fd;             /* backing file, or -1 for an anonymous arena */
+    char *path;
+    char *base;         /* mapping of the log */
+    u64 size;           /* mapped size */
+    u64 tail;           /* offset of the next record */
+    u64 live;           /* bytes of records still referenced */
+    u64 dead;           /* bytes of records that have been released */
+};
+
+struct vlog *vlog_new(const char *path);
+u64 vlog_append(struct vlog *log, key_t key, const void *value, u32 len);
+void *vlog_get(struct vlog *log, u64 handle, u32 *len);
+void vlog_release(struct vlog *log, u64 handle);
+struct vlog *vlog_begin_compact(struct vlog *log);
+struct vlog *vlog_end_compact(struct vlog *log, struct vlog *new_log);
+void vlog_free(struct vlog *log);
+#endif
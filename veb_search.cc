@@ -0,0 +1,139 @@
+/*
+ *  Lookups for the plain vEB layout, one for each short tree height.
+ *
+ *  Where the links give out, a node's position follows from its bfs
+ *  number through the level_info tables, which only depend on the
+ *  height.  Here they are worked out at compile time and every step
+ *  of the walk down is unrolled, so there are no table loads, no
+ *  checks for which kind of link a depth has and no loop.
+ *  set_height() picks the one for the tree's height; taller trees,
+ *  and blocked and leaf block layouts, use search_once() in
+ *  veb_small_height.c.
+ */
+#include <utility>
+#include "veb_small_height.h"
+#include "veb_search.h"
+
+namespace {
+
+/* as struct level_info */
+struct level
+{
+    int subtree_depth;
+    u64 top_size;
+    u64 top_span;
+    u64 bottom_size;
+};
+
+/* compute_levels() for a tree of height H */
+template <int H>
+struct levels
+{
+    level l[H];
+
+    constexpr levels() : l()
+    {
+        split(0, H);
+    }
+
+    constexpr void split(int top, int height)
+    {
+        if (height == 1)
+            return;
+
+        int top_height = split_height(height);
+        int bottom_height = height - top_height;
+
+        l[top + top_height].subtree_depth = top;
+        l[top + top_height].top_size = tree_size(top_height);
+        l[top + top_height].top_span = tree_size(top_height);
+        l[top + top_height].bottom_size = tree_size(bottom_height);
+
+        split(top, top_height);
+        split(top + top_height, bottom_height);
+    }
+};
+
+template <int H>
+constexpr levels<H> table{};
+
+/*
+ *  One level of the walk, at node, depth D, and the ones below it.
+ *  Nearly every child is found by its link, as in search_once(); the
+ *  one depth where links are only flags, at the root of the bottom
+ *  subtrees, has its offsets from the table as constants.  A walk
+ *  racing the writer that regrows the tree may have the wrong
+ *  height, so it still stays below limit.
+ */
+template <int H, int D>
+__attribute__((always_inline))
+inline struct tree_node *descend(struct veb *veb, struct tree_node *elements,
+                                 u64 limit, const packed_key_t *key,
+                                 struct tree_node *node, u64 pos, u64 bfs,
+                                 u32 **bseq, u32 *bs)
+{
+    constexpr int top = split_height(H);
+    int cmp = compare_key(key, &node->key);
+    bool right;
+    u32 link;
+
+    if (cmp == 0)
+        return node;
+
+    if constexpr (D + 1 == H)
+        return NULL;
+    else
+    {
+        /* which way to go is data, not control flow */
+        right = cmp > 0;
+        link = right ? node->right : node->left;
+        if (!link)
+            return NULL;
+
+        bfs = 2 * bfs + right;
+        if constexpr (D + 1 == top)
+        {
+            constexpr level l = table<H>.l[top];
+
+            *bseq = block_seq(veb, top, bfs);
+            *bs = read_seq_begin(*bseq);
+            pos = l.top_span + (bfs & l.top_size) * l.bottom_size;
+        }
+        else
+            pos += link;
+        if (pos >= limit)
+            return NULL;
+
+        return descend<H, D + 1>(veb, elements, limit, key, &elements[pos],
+                                 pos, bfs, bseq, bs);
+    }
+}
+
+template <int H>
+struct tree_node *search(struct veb *veb, packed_key_t *key, u32 **bseq,
+                         u32 *bs)
+{
+    struct tree_node *node = &veb->elements[0];
+
+    if (node->key.objectid == NULL_KEY)
+        return NULL;
+    return descend<H, 0>(veb, veb->elements, veb->span, key, node, 0, 1,
+                         bseq, bs);
+}
+
+template <size_t... I>
+veb_search_fn pick(int height, std::index_sequence<I...>)
+{
+    static const veb_search_fn fn[] = { search<I + 1>... };
+
+    return fn[height - 1];
+}
+
+}
+
+veb_search_fn veb_search_fixed(int height)
+{
+    if (height < 1 || height > VEB_FIXED_HEIGHT)
+        return NULL;
+    return pick(height, std::make_index_sequence<VEB_FIXED_HEIGHT>());
+}
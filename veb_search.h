@@ -0,0 +1,26 @@
+#ifndef VEB_SEARCH_H
+#define VEB_SEARCH_H
+
+#include "veb_small_height.h"
+
+/*
+ *  Tallest tree with a lookup of its own, 2MB of nodes.  Below that
+ *  the walk is bound by its instructions and unrolling it pays; above
+ *  it, by cache and TLB misses, where the loop measured faster.
+ */
+#define VEB_FIXED_HEIGHT 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  The lookup unrolled for a tree of this height in the plain vEB
+ *  layout, with no blocks or leaf blocks, or NULL if there is none.
+ */
+veb_search_fn veb_search_fixed(int height);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
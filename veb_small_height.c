@@ -1,26 +1,97 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
-#include <glib.h>
 #include "veb_small_height.h"
 #include "bitlib.h"
+#include "veb_search.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <emmintrin.h>
 
-#define NULL_KEY (0ULL)
+/*
+ *  Largest node file, and the address space reserved for the log:
+ *  4TB, room for a tree of height 35 to grow into one of height 36.
+ */
+#define REGION_SIZE (1ULL << 42)
+
+/* the node file is mapped at this alignment, for huge page blocks */
+#define HUGE_SIZE (2ULL << 20)
+
+#define PAGE_SHIFT 12
+#define PAGE_ALIGN(x) (((x) + (1UL << PAGE_SHIFT) - 1) & \
+                       ~((1UL << PAGE_SHIFT) - 1))
+#define MAX_PAGES ((REGION_SIZE >> PAGE_SHIFT) + 1)
+#define DIRTY_LONGS ((MAX_PAGES + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 //#define TEST_BFS
 #define PTR_SEARCH
 
-static inline int tree_size(int height)
+static void grow_begin(struct veb *veb);
+static void grow_step(struct veb *veb);
+static void grow_end(struct veb *veb);
+static void grow_finish(struct veb *veb);
+static void move_chunk(struct veb *veb, u64 bfs);
+static void grow_prepare(struct veb *veb, packed_key_t *key);
+static u64 old_chunk(struct veb *veb, packed_key_t *key);
+static void repair_path(struct veb *veb, u64 bfs);
+static struct tree_node *search_once(struct veb *veb, packed_key_t *key,
+                                     u32 **bseq, u32 *bs);
+
+/* n rounded up to whole blocks of the given height */
+static inline u64 align_block(u64 n, int block)
+{
+    return (n + (1ULL << block) - 1) & ~((1ULL << block) - 1);
+}
+
+/*
+ *  The slots a tree of this height takes.  Blocked, that is the tree
+ *  above the bottom layer of blocks, padded to a whole block, and
+ *  then the layer, 2^block slots per block.
+ */
+static u64 tree_span(int height, int block)
+{
+    if (!block)
+        return 1ULL << height;
+    if (height <= block)
+        return 1ULL << block;
+    return tree_span(height - block, block) + (1ULL << height);
+}
+
+/*
+ *  The first node index a tree can start at with its blocks aligned
+ *  in the file, which puts them on page, or huge page, boundaries.
+ */
+static inline u64 first_base(int block)
+{
+    u64 header = VEB_HEADER_SIZE / sizeof(struct tree_node);
+
+    return align_block(header, block) - header;
+}
+
+/*
+ *  Note that the page holding p has been written.  Call it after the
+ *  store.  Only the first write to a clean page pays for an atomic op;
+ *  after that it is a load and a test.
+ */
+static inline void mark_dirty(struct veb *veb, void *p)
 {
-    return (1 << height) - 1;
+    unsigned long page = ((char *) p - (char *) veb->super) >> PAGE_SHIFT;
+    unsigned long *word = &veb->dirty[page / BITS_PER_LONG];
+    unsigned long bit = 1UL << (page % BITS_PER_LONG);
+
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+        __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
 }
 
 /*
@@ -30,24 +101,24 @@ static inline int tree_size(int height)
  *  this should still be much faster than recursion.
  */
 
-static int bfs_to_veb_lu(struct level_info *l, int bfs_num)
+static u64 bfs_to_veb_lu(struct level_info *l, u64 bfs_num)
 {
-    int pos[100];
+    u64 pos[100];
     int d = 0;
-    int i;
+    u64 i;
 
 #ifdef TEST_BFS
     return bfs_num;
 #endif
 
-    int level = ilog2(bfs_num);
+    int level = ilog2_64(bfs_num);
 
     pos[0] = 1;
     for (; d <= level; d++)
     {
         i = bfs_num >> (level - d);
 
-        pos[d] = pos[l[d].subtree_depth] + l[d].top_size +
+        pos[d] = pos[l[d].subtree_depth] + l[d].top_span +
             (i & l[d].top_size) * (l[d].bottom_size);
     }
     return pos[d-1];
@@ -56,25 +127,25 @@ static int bfs_to_veb_lu(struct level_info *l, int bfs_num)
 /*
  *  Setup pos tracking array for a given root.
  */
-static int fill_pos(struct level_info *l, int bfs_num, int *pos)
+static int fill_pos(struct level_info *l, u64 bfs_num, u64 *pos)
 {
     int d = 0;
-    int i;
+    u64 i;
 
-    int level = ilog2(bfs_num);
+    int level = ilog2_64(bfs_num);
 
     pos[0] = 0;
     for (; d <= level; d++)
     {
         i = bfs_num >> (level - d);
 
-        pos[d] = pos[l[d].subtree_depth] + l[d].top_size +
+        pos[d] = pos[l[d].subtree_depth] + l[d].top_span +
             (i & l[d].top_size) * (l[d].bottom_size);
     }
     return level;
 }
 
-static int bfs_to_veb(struct veb *veb, int bfs_num, int height)
+static u64 bfs_to_veb(struct veb *veb, u64 bfs_num, int height)
 {
     (void)height;
     return bfs_to_veb_lu(veb->level_info, bfs_num);
@@ -86,22 +157,23 @@ static int bfs_to_veb(struct veb *veb, int bfs_num, int height)
  *  BFS number is in the range of 1..#nodes.  The return value
  *  is also 1-indexed.
  */
-static int bfs_to_veb_recur(struct veb *veb, int bfs_number, int height)
+static u64 bfs_to_veb_recur(struct veb *veb, u64 bfs_number, int height)
 {
     int split;
     int top_height, bottom_height;
     int depth;
-    int subtree_depth, subtree_root, num_subtrees;
-    int toptree_size, subtree_size;
-    unsigned int mask;
-    int prior_length;
+    int subtree_depth;
+    u64 subtree_root, num_subtrees;
+    u64 toptree_size, subtree_size;
+    u64 mask;
+    u64 prior_length;
 
     /* if this is a size-3 tree, bfs number is sufficient */
     if (height <= 2)
         return bfs_number;
 
     /* depth is level of the specific node */
-    depth = ilog2(bfs_number);
+    depth = ilog2_64(bfs_number);
 
     /* the vEB layout recursively splits the tree in half */
     split = hyperceil((height + 1) / 2);
@@ -128,12 +200,12 @@ static int bfs_to_veb_recur(struct veb *veb, int bfs_number, int height)
      */
 
     /* mask off common bits */
-    num_subtrees = 1 << top_height;
+    num_subtrees = 1ULL << top_height;
     mask = subtree_root << subtree_depth;
     bfs_number &= ~mask;
 
     /* replace it with one */
-    bfs_number |= 1 << subtree_depth;
+    bfs_number |= 1ULL << subtree_depth;
 
     /*
      * Now we need to count all the nodes before this one, then the
@@ -141,8 +213,8 @@ static int bfs_to_veb_recur(struct veb *veb, int bfs_number, int height)
      * this subtree root in the layout is the bottom k-1 bits of the
      * subtree root.
      */
-    subtree_size = (1 << bottom_height) - 1;
-    toptree_size = (1 << top_height) - 1;
+    subtree_size = tree_size(bottom_height);
+    toptree_size = tree_size(top_height);
 
     prior_length = toptree_size +
         (subtree_root & (num_subtrees - 1)) * subtree_size;
@@ -150,23 +222,6 @@ static int bfs_to_veb_recur(struct veb *veb, int bfs_number, int height)
     return prior_length + bfs_to_veb_recur(veb, bfs_number, bottom_height);
 }
 
-static inline int compare_key(btrfs_key_t *k1, btrfs_key_t *k2)
-{
-    if (k1->objectid > k2->objectid)
-            return 1;
-    if (k1->objectid < k2->objectid)
-            return -1;
-    if (k1->type > k2->type)
-            return 1;
-    if (k1->type < k2->type)
-            return -1;
-    if (k1->offset > k2->offset)
-            return 1;
-    if (k1->offset < k2->offset)
-            return -1;
-    return 0;
-}
-
 static void compute_levels(struct level_info *l, int top, int height)
 {
     int split, top_height, bottom_height;
@@ -180,35 +235,148 @@ static void compute_levels(struct level_info *l, int top, int height)
 
     l[top + top_height].subtree_depth = top;
     l[top + top_height].top_size = tree_size(top_height);
+    l[top + top_height].top_span = tree_size(top_height);
     l[top + top_height].bottom_size = tree_size(bottom_height);
 
     compute_levels(l, top, top_height);
     compute_levels(l, top + top_height, bottom_height);
 }
 
+/*
+ *  The blocked layout stops the vEB recursion at subtrees of height
+ *  block instead of single nodes.  The tree is cut into layers of
+ *  them from the bottom up; each layer follows the ones above it,
+ *  block by block in order, with every block padded to 2^block slots
+ *  so that they stay aligned.  Inside a block the layout is plain vEB.
+ */
+static void compute_blocks(struct level_info *l, int height, int block)
+{
+    int top = height - block;
+
+    if (top <= 0)
+    {
+        compute_levels(l, 0, height);
+        return;
+    }
+
+    l[top].subtree_depth = 0;
+    l[top].top_size = tree_size(top);
+    l[top].top_span = tree_span(top, block);
+    l[top].bottom_size = 1ULL << block;
+
+    compute_blocks(l, top, block);
+    compute_levels(l, top, block);
+}
 
-static int compute_level_info(struct level_info *l, int height)
+static int compute_level_info(struct level_info *l, int height, int block)
 {
-    compute_levels(l, 0, height);
+    if (block)
+        compute_blocks(l, height, block);
+    else
+        compute_levels(l, 0, height);
     memset(&l[0], 0, sizeof(l[0]));
     return 0;
 }
 
-static inline struct tree_node *node_at_pos(struct veb *veb, int bfs_num,
-                                            int *pos, int d)
+/*
+ *  Lay the bottom subtrees of height leaf out in in-order, so that
+ *  each is a sorted array of its keys with gaps for the empty slots.
+ *  Only a subtree the layout keeps in one piece can be, so leaf comes
+ *  down until they are.  The root, at the start of the piece in vEB
+ *  order, moves to the middle.  Returns the depth of the leaf blocks'
+ *  roots, or height if there are none.
+ */
+static int compute_leaves(struct level_info *l, int height, int leaf)
+{
+    int top, d, r;
+
+    for (leaf = min(leaf, height - 1); leaf > 1; leaf--)
+    {
+        top = height - leaf;
+        for (d = top + 1; d < height && l[d].subtree_depth >= top; d++)
+            ;
+        if (d == height)
+            break;
+    }
+    if (leaf <= 1)
+        return height;
+
+    l[top].top_span += tree_size(leaf - 1);
+    for (r = 1; r < leaf; r++)
+    {
+        /* the span is negative, from the root in the middle */
+        l[top + r].subtree_depth = top;
+        l[top + r].top_size = tree_size(r);
+        l[top + r].top_span = (1ULL << (leaf - 1 - r)) - (1ULL << (leaf - 1));
+        l[top + r].bottom_size = 1ULL << (leaf - r);
+    }
+    return top;
+}
+
+/*
+ *  The depths whose links are only flags: those where the layout
+ *  starts over from the root, below the top of the outermost split or
+ *  at each layer of blocks, as those can be too far for 32 bits.
+ */
+static u64 far_links(int height, int block)
+{
+    u64 far = 0;
+    int d;
+
+    if (!block)
+        return height > 1 ? 1ULL << split_height(height) : 0;
+    for (d = height - block; d > 0; d -= block)
+        far |= 1ULL << d;
+    return far;
+}
+
+static void set_height(struct veb *veb, int height)
+{
+    compute_level_info(veb->level_info, height, veb->block_height);
+    veb->leaf_depth = compute_leaves(veb->level_info, height,
+                                     veb->leaf_height);
+    veb->height = height;
+    veb->top_height = split_height(height);
+    veb->far_links = far_links(height, veb->block_height);
+    veb->span = tree_span(height, veb->block_height);
+
+    /* short trees in the plain layout have a lookup of their own */
+    veb->search = NULL;
+    if (!veb->block_height && veb->leaf_depth == height)
+        veb->search = veb_search_fixed(height);
+    if (!veb->search)
+        veb->search = search_once;
+}
+
+/*
+ *  The sequence count covering the subtree under bfs: its bottom
+ *  block's if it lies inside one, else the whole tree's.
+ */
+static inline u32 *subtree_seq(struct veb *veb, u64 bfs)
+{
+    int top = veb->top_height;
+    int d = ilog2_64(bfs);
+
+    if (top <= 0 || d < top)
+        return &veb->seq;
+    return block_seq(veb, top, bfs >> (d - top));
+}
+
+static inline struct tree_node *node_at_pos(struct veb *veb, u64 bfs_num,
+                                            u64 *pos, int d)
 {
     struct level_info *l = veb->level_info;
 #ifdef TEST_BFS
     return node_at(veb, bfs_num);
 #else
-    pos[d] = pos[l[d].subtree_depth] + l[d].top_size +
+    pos[d] = pos[l[d].subtree_depth] + l[d].top_span +
          (bfs_num & l[d].top_size) * (l[d].bottom_size);
 
     return &veb->elements[pos[d]];
 #endif
 }
 
-static inline struct tree_node *node_at(struct veb *veb, int bfs)
+static inline struct tree_node *node_at(struct veb *veb, u64 bfs)
 {
     return &veb->elements[bfs_to_veb(veb, bfs, veb->height) - 1];
 }
@@ -218,41 +386,40 @@ static inline bool node_empty(struct tree_node *node)
     return node->key.objectid == NULL_KEY;
 }
 
-static inline bool node_valid(struct veb *veb, int bfs)
+static inline bool node_valid_pos(struct veb *veb, u64 bfs, u64 *pos)
 {
     return bfs > 0 &&
-        bfs <= ((1 << veb->height) - 1) &&
-        !node_empty(node_at(veb, bfs));
+        bfs <= tree_size(veb->height) &&
+        !node_empty(node_at_pos(veb, bfs, pos, ilog2_64(bfs)));
 }
 
-static inline bool node_valid_pos(struct veb *veb, int bfs)
+static inline u64 bfs_left(u64 bfs_num)
 {
-    return bfs > 0 &&
-        bfs <= ((1 << veb->height) - 1) &&
-        !node_empty(node_at_pos(veb, bfs, veb->iter_pos, ilog2(bfs)));
+    return 2 * bfs_num;
 }
 
-static inline int bfs_left(int bfs_num)
+static inline u64 bfs_right(u64 bfs_num)
 {
-    return 2 * bfs_num;
+    return 2 * bfs_num + 1;
 }
 
-static inline int bfs_right(int bfs_num)
+/* the right child if right, else the left, without a branch */
+static inline u64 bfs_child(u64 bfs_num, bool right)
 {
-    return 2 * bfs_num + 1;
+    return 2 * bfs_num + right;
 }
 
-static inline int bfs_parent(int bfs_num)
+static inline u64 bfs_parent(u64 bfs_num)
 {
     return bfs_num / 2;
 }
 
-static inline int bfs_is_right(int bfs_num)
+static inline int bfs_is_right(u64 bfs_num)
 {
     return bfs_num & 1;
 }
 
-static inline int bfs_peer(int bfs_num)
+static inline u64 bfs_peer(u64 bfs_num)
 {
     if (bfs_is_right(bfs_num))
         return bfs_num & ~1;
@@ -260,36 +427,70 @@ static inline int bfs_peer(int bfs_num)
     return bfs_num | 1;
 }
 
-static int bfs_first(struct veb *veb, int subtree_root)
+/*
+ *  The link to store from the node at pos[d-1] to its child at pos[d].
+ *  One at a far depth, or inside a leaf block, where a left child
+ *  comes first, only says there is a child, which follow_link finds
+ *  again from its bfs number.
+ */
+static inline u32 make_link(struct veb *veb, u64 *pos, int d)
+{
+    return veb->far_links >> d & 1 || d > veb->leaf_depth ?
+        1 : pos[d] - pos[d-1];
+}
+
+/* the position of the child at bfs, depth d, linked from pos */
+static inline u64 follow_link(struct veb *veb, u64 pos, u32 link, u64 bfs,
+                              int d)
 {
-    int bfs = subtree_root;
+    struct level_info *l = &veb->level_info[d];
+    u64 half;
 
-    fill_pos(veb->level_info, subtree_root, veb->iter_pos);
+    if (veb->far_links >> d & 1)
+        return l->top_span + (bfs & l->top_size) * l->bottom_size;
+    if (d > veb->leaf_depth)
+    {
+        half = 1ULL << (veb->height - 1 - d);
+        return bfs_is_right(bfs) ? pos + half : pos - half;
+    }
+    return pos + link;
+}
 
-    if (!node_valid_pos(veb, bfs))
-        return -1;
+/*
+ *  In-order walk by bfs number.  The caller owns pos, which holds
+ *  the element index of each node on the path to the current one.
+ */
+static u64 bfs_first(struct veb *veb, u64 subtree_root, u64 *pos)
+{
+    u64 bfs = subtree_root;
+
+    fill_pos(veb->level_info, subtree_root, pos);
+
+    if (!node_valid_pos(veb, bfs, pos))
+        return 0;
 
-    while (node_valid_pos(veb, bfs))
+    while (node_valid_pos(veb, bfs, pos))
         bfs = bfs_left(bfs);
 
     return bfs_parent(bfs);
 }
 
-static int bfs_next(struct veb *veb, int bfs_num, int subtree_root)
+static u64 bfs_next(struct veb *veb, u64 bfs_num, u64 subtree_root,
+                    u64 *pos)
 {
-    int bfs_next, tail;
+    u64 bfs_next, tail;
 
     /* If at root with no right child, done */
     if (bfs_num == subtree_root &&
-        !node_valid_pos(veb, bfs_right(bfs_num)))
-        return -1;
+        !node_valid_pos(veb, bfs_right(bfs_num), pos))
+        return 0;
 
     /* If there's a right child, go right then all the way left */
-    if (node_valid_pos(veb, bfs_right(bfs_num)))
+    if (node_valid_pos(veb, bfs_right(bfs_num), pos))
     {
         bfs_next = bfs_right(bfs_num);
 
-        while (node_valid_pos(veb, bfs_next))
+        while (node_valid_pos(veb, bfs_next, pos))
             bfs_next = bfs_left(bfs_next);
 
         return bfs_parent(bfs_next);
@@ -307,27 +508,28 @@ static int bfs_next(struct veb *veb, int bfs_num, int subtree_root)
 
     /* at root from right side? */
     if (bfs_next <= subtree_root && bfs_is_right(tail))
-        return -1;
+        return 0;
 
     return bfs_next;
 }
 
 void veb_tree_print_in_order(struct veb *veb)
 {
-    int bfs = bfs_first(veb, 1);
+    u64 pos[MAX_HEIGHT];
+    u64 bfs = bfs_first(veb, 1, pos);
 
-    while (bfs != -1)
+    while (bfs)
     {
         printf("%lld\n", (unsigned long long) node_at(veb, bfs)->key.objectid);
-        bfs = bfs_next(veb, bfs, 1);
+        bfs = bfs_next(veb, bfs, 1, pos);
     }
     printf("\n");
 }
 
 void veb_tree_print(struct veb *veb)
 {
-    int i;
-    for (i=0; i < (1 << veb->height) - 1; i++)
+    u64 i;
+    for (i=0; i < tree_size(veb->height); i++)
     {
         if (is_power_of_two(i+1))
             printf("\n");
@@ -344,9 +546,9 @@ void veb_tree_print(struct veb *veb)
  *
  * Result in 16.16 fixed point.
  */
-int density(int occupation, int height)
+int density(u64 occupation, int height)
 {
-    int nodes = tree_size(height);
+    u64 nodes = tree_size(height);
     u64 tmp = occupation;
     return ((tmp << 16) + 0x8000) / nodes;
 }
@@ -364,9 +566,9 @@ int target_density(struct veb *veb, int height)
          ((height << 16) / veb->height);
 }
 
-double density_f(int occupation, int height)
+double density_f(u64 occupation, int height)
 {
-    int nodes = tree_size(height);
+    u64 nodes = tree_size(height);
     return (double) occupation / nodes;
 }
 
@@ -379,279 +581,965 @@ double target_density_f(struct veb *veb, int height)
         (maxd - mind) * (((double)height - 2)/ veb->height);
 }
 
-void veb_tree_distribute_inner(struct veb *veb, int bfs_root,
-                               struct tree_node *scratch, int ofs, int count,
-                               int *pos, int d)
+/*
+ *  The density an insert may fill a subtree to: a leaf block takes
+ *  keys until it is full, shifting them about inside, and only then
+ *  spills into the subtrees above it.
+ */
+double fill_target_f(struct veb *veb, int height)
 {
-    int item = count/2;
-    int left_ct = item;
-    int right_ct = count - item - 1;
-
-    assert(d < veb->height);
+    if (height <= veb->height - veb->leaf_depth)
+        return veb->max_density / 65536.0;
+    return target_density_f(veb, height);
+}
 
-    memcpy(node_at_pos(veb, bfs_root, pos, d), &scratch[ofs + item],
-           sizeof(scratch[0]));
+/*
+ *  The density a subtree may fall to before a delete spreads its
+ *  neighbours into it: nothing for the smallest subtrees, rising to
+ *  a quarter of min_density at the root, below which the tree
+ *  shrinks.
+ */
+double lower_density_f(struct veb *veb, int height)
+{
+    double mind = veb->min_density / 65536.0;
 
-    if (left_ct > 0)
-        veb_tree_distribute_inner(veb, bfs_left(bfs_root), scratch, ofs,
-                                  left_ct, pos, d+1);
-    if (right_ct > 0)
-        veb_tree_distribute_inner(veb, bfs_right(bfs_root), scratch,
-            ofs + item + 1, right_ct, pos, d+1);
+    if (veb->height <= 2 || height <= 2)
+        return 0;
+    return mind / 4 * ((double)height - 2) / (veb->height - 2);
 }
 
-void veb_tree_distribute(struct veb *veb, int bfs_root,
-                         struct tree_node *scratch, int ofs, int count)
+/*
+ *  A finger walks every slot of a subtree in order, empty or not,
+ *  keeping the path to the slot it is on in pos.
+ */
+struct finger {
+    u64 root;
+    u64 bfs;
+    int d;
+    u64 pos[MAX_HEIGHT];
+};
+
+static inline struct tree_node *finger_node(struct veb *veb, struct finger *f)
 {
-    int pos[MAX_HEIGHT];
-    int depth;
+    return &veb->elements[f->pos[f->d]];
+}
 
-    assert(bfs_root < (1 << veb->height));
+/* put f on the slot of the given in-order rank under root */
+static void finger_seek(struct veb *veb, struct finger *f, u64 root, u64 rank)
+{
+    u64 half;
 
-    depth = fill_pos(veb->level_info, bfs_root, pos);
-    veb_tree_distribute_inner(veb, bfs_root, scratch, ofs, count, pos, depth);
+    f->root = f->bfs = root;
+    f->d = fill_pos(veb->level_info, root, f->pos);
+    while (rank != (half = tree_size(veb->height - f->d - 1)))
+    {
+        f->bfs = rank < half ? bfs_left(f->bfs) : bfs_right(f->bfs);
+        if (rank > half)
+            rank -= half + 1;
+        node_at_pos(veb, f->bfs, f->pos, ++f->d);
+    }
 }
 
-static int tree_occupation_inner(struct veb *veb, int bfs_root)
+/* step to the next slot, or the one before; false off the end */
+static bool finger_step(struct veb *veb, struct finger *f, bool fwd)
 {
-    if (!node_valid_pos(veb, bfs_root))
-        return 0;
+    if (f->d + 1 < veb->height)
+    {
+        /* one down the way we're going, then all the way the other */
+        f->bfs = fwd ? bfs_right(f->bfs) : bfs_left(f->bfs);
+        node_at_pos(veb, f->bfs, f->pos, ++f->d);
+        while (f->d + 1 < veb->height)
+        {
+            f->bfs = fwd ? bfs_left(f->bfs) : bfs_right(f->bfs);
+            node_at_pos(veb, f->bfs, f->pos, ++f->d);
+        }
+        return true;
+    }
 
-    return 1 + tree_occupation_inner(veb, bfs_left(bfs_root)) +
-               tree_occupation_inner(veb, bfs_right(bfs_root));
+    /* from a leaf, up past every ancestor we are on the far side of */
+    while (f->bfs != f->root && bfs_is_right(f->bfs) == fwd)
+    {
+        f->bfs = bfs_parent(f->bfs);
+        f->d--;
+    }
+    if (f->bfs == f->root)
+        return false;
+    f->bfs = bfs_parent(f->bfs);
+    f->d--;
+    return true;
 }
 
 /*
- *  Returns the number of non-empty nodes in the subtree rooted
- *  at bfs_root.
+ *  Streaming rebuilds.  A subtree gets the shape distributing a
+ *  sorted array over it would give, the middle key at each root, but
+ *  the keys come one at a time, largest first, from a backward walk
+ *  of a tree merged with a sorted run, and are written in reverse
+ *  in-order as they come.  Only a path is held, so a rebuild needs
+ *  the same memory for the whole tree as for a subtree of ten keys.
+ *
+ *  The tree read may be the one written, once its keys are packed to
+ *  the left end of the subtree: a key's slot is then never after the
+ *  one it is written to, nor after any key's still to be taken, so
+ *  nothing is overwritten before it has been read.
  */
-static int tree_occupation(struct veb *veb, int bfs_root)
+struct stream {
+    struct veb *veb;            /* the tree written */
+    struct veb *from;           /* the tree read, backward from f */
+    struct finger f;
+    u64 left;                   /* keys still to take from it */
+    packed_key_t *drop;         /* a key of it to leave out */
+    packed_key_t *run;          /* sorted keys merged in, from the end */
+    btrfs_key_t *keys;          /* or the caller's, packed as they come */
+    u64 nrun;                   /* of them still to take */
+    u64 done;                   /* keys from this one up are in place */
+    u64 clear;                  /* only slots below this rank can be stale */
+    u64 taken[2];               /* from the tree and from the run so far */
+    u64 *placed;                /* where to count keys placed, if anywhere */
+};
+
+static inline packed_key_t run_key(struct stream *s, u64 i)
 {
-    int res;
-    fill_pos(veb->level_info, bfs_root, veb->iter_pos);
-    res = tree_occupation_inner(veb, bfs_root);
-
-    return res;
+    return s->keys ? pack_key(&s->keys[i]) : s->run[i];
 }
 
-static int serialize(struct veb *veb, int bfs_root, btrfs_key_t *insert,
-                     struct tree_node *scratch)
+/* move f back onto the next key to take */
+static void stream_seek(struct stream *s)
 {
-    int count = 0;
-    int bfs = bfs_first(veb, bfs_root);
-    bool inserted = false;
     struct tree_node *node;
 
-    GQueue *queue = g_queue_new();
+    while (s->left)
+    {
+        node = finger_node(s->from, &s->f);
+        if (!node_empty(node) &&
+            (!s->drop || compare_key(&node->key, s->drop)))
+            return;
+        finger_step(s->from, &s->f, false);
+    }
+}
 
-    while (bfs != -1)
+/* take left keys from the tree from, backward from rank under root */
+static void stream_from(struct stream *s, struct veb *from, u64 root,
+                        u64 rank, u64 left)
+{
+    s->from = from;
+    s->left = left;
+    if (left)
     {
-        struct tree_node *node = node_at_pos(veb, bfs, veb->iter_pos,
-            ilog2(bfs));
+        finger_seek(from, &s->f, root, rank);
+        stream_seek(s);
+    }
+}
+
+/* the largest key left, into n; the tree and run must not share keys */
+static void stream_take(struct stream *s, struct tree_node *n)
+{
+    struct tree_node *node = s->left ? finger_node(s->from, &s->f) : NULL;
+    packed_key_t key = { 0, 0 };
+    packed_key_t next;
 
-        if (insert && compare_key(insert, &node->key) < 0 && !inserted) {
-            memcpy(&scratch[count++].key, insert, sizeof(*insert));
-            inserted = true;
+    if (s->nrun)
+        key = run_key(s, s->nrun - 1);
+    if (node && (!s->nrun || compare_key(&node->key, &key) > 0))
+    {
+        *n = *node;
+        s->taken[0]++;
+        if (--s->left)
+        {
+            finger_step(s->from, &s->f, false);
+            stream_seek(s);
         }
-        g_queue_push_tail(queue, node);
+        return;
+    }
 
-        memcpy(&scratch[count++].key, &node->key, sizeof(node->key));
+    memset(n, 0, sizeof(*n));
+    n->key = key;
+    s->taken[1]++;
+    s->nrun--;
 
-        bfs = bfs_next(veb, bfs, bfs_root);
+    /* the caller's keys may repeat */
+    while (s->nrun && (next = run_key(s, s->nrun - 1),
+                       !compare_key(&next, &key)))
+    {
+        s->taken[1]++;
+        s->nrun--;
     }
+}
+
+/* empty whatever is left in a subtree that gets no keys */
+static void stream_clear(struct stream *s, u64 bfs, u64 *pos, int d, u64 lo)
+{
+    struct veb *veb = s->veb;
+    struct tree_node *node;
 
-    if (!inserted && insert)
-        memcpy(&scratch[count++].key, insert, sizeof(*insert));
+    if (lo >= s->clear)
+        return;
 
-    while (!g_queue_is_empty(queue))
+    node = node_at_pos(veb, bfs, pos, d);
+    if (!node_empty(node))
     {
-        node = g_queue_pop_head(queue);
-        node->key.objectid = NULL_KEY;
+        memset(node, 0, sizeof(*node));
+        mark_dirty(veb, node);
+    }
+    if (d + 1 < veb->height)
+    {
+        stream_clear(s, bfs_left(bfs), pos, d + 1, lo);
+        stream_clear(s, bfs_right(bfs), pos, d + 1,
+                     lo + tree_size(veb->height - d - 1) + 1);
     }
-    g_queue_free(queue);
-
-    return count;
 }
 
-static int mem_used = 0;
-void *setup_mmap(int initial_size, bool clear)
+/*
+ *  Write count keys into the subtree at bfs, depth d, right to left.
+ *  first is the index among all the keys streamed of the first one it
+ *  gets, and lo the in-order rank of its first slot.  Keys already in
+ *  place are not taken again, but links and counts are always written.
+ */
+static void stream_subtree(struct stream *s, u64 bfs, u64 *pos, int d,
+                           u64 first, u64 count, u64 lo)
 {
-    void *ptr;
-    char *fn = "mmap_region.dat";
-    int res;
-    int flags = O_RDWR | O_CREAT;
+    struct veb *veb = s->veb;
+    struct tree_node *node = node_at_pos(veb, bfs, pos, d);
+    u64 item = count / 2;
+    u32 left = 0, right = 0;
+    struct tree_node n;
 
-    if (clear)
-        flags |= O_TRUNC;
+    if (count == 0)
+    {
+        stream_clear(s, bfs, pos, d, lo);
+        return;
+    }
 
-    int fd = open(fn, flags, 0644);
-    if (fd < 0) {
-        perror("open");
-        return NULL;
+    if (d + 1 < veb->height)
+    {
+        stream_subtree(s, bfs_right(bfs), pos, d + 1, first + item + 1,
+                       count - item - 1,
+                       lo + tree_size(veb->height - d - 1) + 1);
+        if (count - item - 1)
+            right = make_link(veb, pos, d + 1);
     }
 
-    ptr = mmap(NULL, 0x7fffffff, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED)
+    if (first + item < s->done)
     {
-        perror("mmap");
-        die("");
+        stream_take(s, &n);
+        *node = n;
+        if (s->placed)
+            __atomic_store_n(s->placed, *s->placed + 1, __ATOMIC_RELEASE);
     }
-    res = ftruncate(fd, 0x7fffffff);
-    if (res < 0)
+    node->count = count;
+
+    if (d + 1 < veb->height)
     {
-        perror("ftruncate");
-        die("");
+        stream_subtree(s, bfs_left(bfs), pos, d + 1, first, item, lo);
+        if (item)
+            left = make_link(veb, pos, d + 1);
     }
+    node->left = left;
+    node->right = right;
+    mark_dirty(veb, node);
+}
 
-    mem_used = initial_size;
+static void stream_tree(struct stream *s, u64 bfs, u64 count)
+{
+    u64 pos[MAX_HEIGHT];
+    int d = fill_pos(s->veb->level_info, bfs, pos);
 
-    return ptr;
+    stream_subtree(s, bfs, pos, d, 0, count, 0);
 }
 
-void *realloc_mem(void *ptr, int new_size)
+/*
+ *  Pack the keys under bfs into its leftmost slots, in order, and
+ *  empty the rest, leaving out drop and any key in run, which is
+ *  merged back in after.  Returns how many are kept.  A key is copied
+ *  before its old slot is emptied, and one no greater than the last
+ *  kept is dropped, so doing it again after a crash part way still
+ *  keeps each key once.
+ */
+static u64 compact_subtree(struct veb *veb, u64 bfs, packed_key_t *run,
+                           u64 nrun, packed_key_t *drop)
 {
-    mem_used = new_size;
-    return ptr;
+    struct finger r, w;
+    struct tree_node *node, *to, *last = NULL;
+    u64 kept = 0, i = 0;
+
+    finger_seek(veb, &r, bfs, 0);
+    w = r;
+    do {
+        node = finger_node(veb, &r);
+        if (node_empty(node))
+            continue;
+
+        while (i < nrun && compare_key(&run[i], &node->key) < 0)
+            i++;
+        if ((last && compare_key(&node->key, &last->key) <= 0) ||
+            (drop && !compare_key(&node->key, drop)) ||
+            (i < nrun && !compare_key(&run[i], &node->key)))
+        {
+            memset(node, 0, sizeof(*node));
+            mark_dirty(veb, node);
+            continue;
+        }
+
+        to = finger_node(veb, &w);
+        if (to != node)
+        {
+            *to = *node;
+            mark_dirty(veb, to);
+            memset(node, 0, sizeof(*node));
+            mark_dirty(veb, node);
+        }
+        last = to;
+        kept++;
+        finger_step(veb, &w, true);
+    } while (finger_step(veb, &r, true));
+
+    return kept;
 }
 
-void release_memory(void *ptr)
+/*
+ *  In durable mode, wait for fd's dirty pages to reach the disk.  The
+ *  shared mappings only outlive the process, not the machine.
+ */
+static void sync_fd(struct veb *veb, int fd)
 {
-    msync(ptr, 0x7fffffff, MS_SYNC);
-    munmap(ptr, 0x7fffffff);
+    if (veb->durable && fdatasync(fd) < 0)
+        perror("fdatasync");
 }
 
-void save_veb_info(struct veb *veb)
+/*
+ *  Record the operation about to start.  op goes in last, so open
+ *  never sees a half-written intent.  In durable mode a rebuild only
+ *  starts once its keys, then the intent with the tree it rebuilds
+ *  from, are on disk: an intent that got there first would replay a
+ *  log that never did.
+ */
+static inline void begin_op(struct veb *veb, u32 op, int height, u64 bfs,
+                            u64 count, packed_key_t *key)
 {
-    FILE *fp = fopen("veb_info.txt", "w");
-    if (!fp) {
-        die("writing veb info");
-    }
-    fprintf(fp, "%d\n%d\n", veb->height, veb->count);
-    fclose(fp);
+    struct veb_intent *in = &veb->super->intent;
+    bool rebuild = op == VEB_OP_REBALANCE || op == VEB_OP_PRUNE;
+
+    if (rebuild && count)
+        sync_fd(veb, veb->log_fd);
+
+    in->height = height;
+    in->bfs = bfs;
+    in->count = count;
+    if (key)
+        in->key = *key;
+    in->total = -1;
+    in->placed = 0;
+    __atomic_store_n(&in->op, op, __ATOMIC_RELEASE);
+    mark_dirty(veb, in);
+
+    if (rebuild)
+        sync_fd(veb, veb->fd);
 }
 
-void load_veb_info(struct veb *veb)
+static inline void end_op(struct veb *veb)
 {
-    int height = 0, count = 0, res;
+    __atomic_store_n(&veb->super->intent.op, VEB_OP_NONE, __ATOMIC_RELEASE);
+}
 
-    FILE *fp = fopen("veb_info.txt", "r");
-    if (!fp) {
-        die("reading veb info");
-    }
-    res = fscanf(fp, "%d\n%d\n", &height, &count);
-    assert(res == 2);
-    fclose(fp);
+/* the key a stream of count keys into the subtree at bfs puts i-th */
+static packed_key_t *streamed_key(struct veb *veb, u64 bfs, u64 count, u64 i)
+{
+    u64 pos[MAX_HEIGHT];
+    int d = fill_pos(veb->level_info, bfs, pos);
+    u64 item;
 
-    veb->height = height;
-    veb->count = count;
+    while (i != (item = count / 2))
+    {
+        if (i < item)
+        {
+            count = item;
+            bfs = bfs_left(bfs);
+        }
+        else
+        {
+            i -= item + 1;
+            count -= item + 1;
+            bfs = bfs_right(bfs);
+        }
+        node_at_pos(veb, bfs, pos, ++d);
+    }
+    return &veb->elements[pos[d]].key;
 }
 
-
 /*
- *  Embiggen the tree.
+ *  Rebuild the subtree the intent names in place: merging in the keys
+ *  in the log, or without the intent's key for a prune.  The keys are
+ *  packed to the left first, then streamed back out from the right.
+ *  Everything it needs is in the intent and the log, and it records
+ *  there how far it got, so recovery just calls it again.  Returns
+ *  the number of keys the subtree ends up with.
  */
-void veb_tree_grow(struct veb *veb)
+static u64 rebuild_subtree(struct veb *veb)
 {
-    int height = veb->height + 1;
-    int newsize = 1 << height;
-    struct tree_node *new_elem;
-    struct level_info *li;
-    struct tree_node *new_scratch;
-    int count;
+    struct veb_intent *in = &veb->super->intent;
+    bool prune = in->op == VEB_OP_PRUNE;
+    u64 nrun = prune ? 0 : in->count;
+    struct stream s = { .veb = veb };
+    packed_key_t *last;
+    u64 rest;
+
+    if (in->total < 0)
+    {
+        in->kept = compact_subtree(veb, in->bfs, veb->log, nrun,
+                                   prune ? &in->key : NULL);
+        __atomic_store_n(&in->total, in->kept + nrun, __ATOMIC_RELEASE);
+    }
+    assert((u64) in->total <= tree_size(veb->height - ilog2_64(in->bfs)));
 
-    new_elem = realloc_mem(veb->elements, sizeof(*new_elem) * newsize);
-    new_scratch = malloc(sizeof(*new_scratch) * newsize);
-    li = malloc(sizeof(*li) * height);
-    compute_level_info(li, height);
+    /*
+     *  Only the number of keys placed is recorded.  The run keys among
+     *  them are the ones no smaller than the last key placed.
+     */
+    if (in->placed)
+    {
+        last = streamed_key(veb, in->bfs, in->total, in->total - in->placed);
+        while (s.taken[1] < nrun &&
+               compare_key(&veb->log[nrun - 1 - s.taken[1]], last) >= 0)
+            s.taken[1]++;
+    }
+    s.taken[0] = in->placed - s.taken[1];
+    s.run = veb->log;
+    s.nrun = nrun - s.taken[1];
+    s.done = in->total - s.taken[0] - s.taken[1];
+    s.clear = in->kept;
+    s.placed = &in->placed;
+
+    rest = in->kept - s.taken[0];
+    stream_from(&s, veb, in->bfs, rest - 1, rest);
+    stream_tree(&s, in->bfs, in->total);
+    return in->total;
+}
 
-    free(veb->scratch);
-    veb->scratch = new_scratch;
+/* bytes up to the end of a tree of this height starting at node base */
+static inline size_t file_size(u64 base, int height, int block)
+{
+    return VEB_HEADER_SIZE +
+        sizeof(struct tree_node) * (base + tree_span(height, block));
+}
 
-    // serialize entire tree
-    count = serialize(veb, 1, NULL, veb->scratch);
+/* the nodes of a tree that starts base nodes into the file */
+static inline struct tree_node *tree_at(struct veb *veb, u64 base)
+{
+    return (struct tree_node *) ((char *) veb->super + VEB_HEADER_SIZE) +
+        base;
+}
 
-    veb->elements = new_elem;
-    veb->level_info = li;
-    veb->height++;
+/* point view at the tree of the given height at base */
+static void set_view(struct veb *veb, struct veb *view, u64 base, int height)
+{
+    view->super = veb->super;
+    view->dirty = veb->dirty;
+    view->block_height = veb->block_height;
+    view->leaf_height = veb->leaf_height;
+    view->base = base;
+    view->elements = tree_at(veb, base);
+    set_height(view, height);
+}
 
-    // now rebuild
-    veb_tree_distribute(veb, 1, veb->scratch, 0, count);
+/* give the blocks of a tree that is no longer used back */
+static void punch_tree(struct veb *veb, u64 base, int height)
+{
+    if (fallocate(veb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  VEB_HEADER_SIZE + base * sizeof(struct tree_node),
+                  tree_span(height, veb->block_height) *
+                  sizeof(struct tree_node)))
+        perror("fallocate");
 }
 
+static u32 header_checksum(struct veb_header *h)
+{
+    u8 *p = (u8 *) h;
+    u32 sum = 2166136261u;
+    size_t i;
+
+    /* FNV-1a over everything before the checksum itself */
+    for (i=0; i < offsetof(struct veb_header, checksum); i++)
+        sum = (sum ^ p[i]) * 16777619u;
+    return sum;
+}
 
 /*
- *  Given a leaf in the tree, compute the density at its parent,
- *  until the density is in range.
- *
- *  Then copy the values into a new array (including search_key).
- *
- *  When done, reinsert all of the keys from the array using
- *  veb_tree_distribute.
+ *  Publish the writer's view of the tree in the older header slot.
+ *  Called with map_lock held, so the flusher never writes back a slot
+ *  half way through being filled in.  The flusher itself never writes
+ *  a header: it only writes back the last one published, which the
+ *  writer only does between operations.
  */
-int veb_tree_rebalance(struct veb *veb, int bfs_num, btrfs_key_t *search_key)
+static void write_header(struct veb *veb)
 {
-    int parent;
-    int height = 2;
-    int count;
+    struct veb_header *h = &veb->super->hdr[++veb->generation & 1];
+
+    h->magic = VEB_MAGIC;
+    h->version = VEB_VERSION;
+    h->node_size = sizeof(struct tree_node);
+    h->height = veb->height;
+    h->count = veb->count;
+    h->min_density = veb->min_density;
+    h->max_density = veb->max_density;
+    h->block_height = veb->block_height;
+    h->leaf_height = veb->leaf_height;
+    h->base = veb->base;
+    h->old_base = veb->migrating ? veb->old->base : 0;
+    h->old_height = veb->migrating ? veb->old->height : 0;
+    h->migrated = veb->migrated;
+    h->moving = veb->moving;
+    h->generation = veb->generation;
+    h->checksum = header_checksum(h);
+    mark_dirty(veb, h);
+}
 
-    /* count the new element and the one in this leaf */
-    int occupation = 2;
+static void publish_header(struct veb *veb)
+{
+    pthread_mutex_lock(&veb->map_lock);
+    write_header(veb);
+    pthread_mutex_unlock(&veb->map_lock);
+}
 
-    /*
-     * find the nearest ancestor w of v with density < target.
-     * we count the occupation of our sibling plus one for the
-     * parent (since the parent must be occupied).  Repeat until
-     * we meet the density.
-     */
-    parent = bfs_parent(bfs_num);
-    fill_pos(veb->level_info, parent, veb->iter_pos);
-    occupation += tree_occupation(veb, bfs_peer(bfs_num)) + 1;
+static bool header_valid(struct veb_header *h, off_t size)
+{
+    if (h->magic != VEB_MAGIC || h->version != VEB_VERSION ||
+        h->node_size != sizeof(struct tree_node) ||
+        h->checksum != header_checksum(h))
+        return false;
+
+    if (h->height >= MAX_HEIGHT || h->block_height > VEB_HUGE_BLOCK ||
+        h->leaf_height > VEB_MAX_LEAF)
+        return false;
+
+    if (h->old_height && (h->old_height >= h->height ||
+                          h->old_base + tree_span(h->old_height,
+                                                  h->block_height) > h->base))
+        return false;
+
+    return h->base < REGION_SIZE &&
+        size >= (off_t) file_size(h->base, h->height, h->block_height);
+}
 
-    while (density_f(occupation, height) > target_density_f(veb, height) &&
-           height < veb->height)
+/*
+ *  Size the file for a tree of the given height and map it.  Address
+ *  space for the largest tree is reserved up front and the file is
+ *  mapped over the start of it, so growing is an ftruncate plus a
+ *  longer mapping at the same address: readers that are still
+ *  walking the old tree never see it unmapped.
+ */
+static void map_file(struct veb *veb, int height)
+{
+    size_t size = file_size(veb->base, height, veb->block_height);
+    size_t slack;
+    void *ptr;
+
+    if (size > REGION_SIZE)
+        die("tree too large");
+
+    if (!veb->super)
     {
-        bfs_num = parent;
-        occupation += tree_occupation(veb, bfs_peer(bfs_num)) + 1;
-        parent = bfs_parent(bfs_num);
-        height++;
+        ptr = mmap(NULL, REGION_SIZE + HUGE_SIZE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            perror("mmap");
+            die("");
+        }
+
+        /* huge page aligned, so that aligned blocks are in memory too */
+        slack = -(uintptr_t) ptr & (HUGE_SIZE - 1);
+        if (slack)
+            munmap(ptr, slack);
+        munmap((char *) ptr + slack + REGION_SIZE, HUGE_SIZE - slack);
+        veb->super = (void *) ((char *) ptr + slack);
     }
-    if (height == veb->height)
+    veb->elements = tree_at(veb, veb->base);
+
+    /*
+     *  Shrinking: readers may still look past the new end until they
+     *  notice, so it is backed by zero pages rather than left to
+     *  fault once the file is cut short.
+     */
+    if (size < veb->map_size)
     {
-        /* table full, rebuild the table */
-        veb_tree_grow(veb);
+        size_t keep = PAGE_ALIGN(size);
+        size_t end = PAGE_ALIGN(veb->map_size);
 
-        /* and retry */
-        return -1;
+        ptr = keep < end ? mmap((char *) veb->super + keep, end - keep,
+                                PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS |
+                                MAP_FIXED, -1, 0) : NULL;
+        if (ptr == MAP_FAILED || ftruncate(veb->fd, size) < 0)
+        {
+            perror("shrink");
+            die("");
+        }
+        bitmap_clear(veb->dirty, keep >> PAGE_SHIFT,
+                     (end - keep) >> PAGE_SHIFT);
+        veb->map_size = size;
+        return;
     }
-       
-    assert(parent > 0);
 
-    /* copy the elements from parent into an array */
-    count = serialize(veb, parent, search_key, veb->scratch);
+    if (ftruncate(veb->fd, size) < 0)
+    {
+        perror("ftruncate");
+        die("");
+    }
 
-    if (count > (1 << height) - 1){
-        printf("count: %d (height %d) occupation %d dens %g\n", count, height,
-                occupation, density_f(occupation,height));
-        assert(count <= (1 << height) - 1);
+    ptr = mmap(veb->super, size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, veb->fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        perror("mmap");
+        die("");
     }
 
-    /* now redistribute */
-    veb_tree_distribute(veb, parent, veb->scratch, 0, count);
-    return 0;
+    /* only a hint: the filesystem may not do huge pages for files */
+    if (veb->block_height >= VEB_HUGE_BLOCK)
+        madvise(ptr, size, MADV_HUGEPAGE);
+
+    veb->map_size = size;
 }
 
 /*
- *  Search through the tree to the first unoccupied node, then
- *  add the value.  If the new depth is greater than the height bound,
- *  then the tree must be rebalanced.
+ *  Map the log.  It only ever holds the keys one rebalance merges in,
+ *  a batch's run at most; the file is sparse and the mapping sized so
+ *  that no batch the node file could take needs it remapped.
  */
-int veb_tree_insert(struct veb *veb, btrfs_key_t *search_key)
+static packed_key_t *setup_log(struct veb *veb, const char *path,
+                               bool create)
 {
-    int res;
+    char fn[PATH_MAX];
+    void *ptr;
+
+    snprintf(fn, sizeof(fn), "%s.log", path);
+    veb->log_fd = open(fn, O_RDWR | O_CREAT | (create ? O_TRUNC : 0), 0644);
+    if (veb->log_fd < 0 || ftruncate(veb->log_fd, REGION_SIZE) < 0)
+    {
+        perror(fn);
+        die("");
+    }
+
+    ptr = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               veb->log_fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        perror("mmap");
+        die("");
+    }
+    veb->allocs++;
+    return ptr;
+}
+
+/*
+ *  Stream count keys from s into a new tree of the given height
+ *  elsewhere in the file, then switch to it.  It goes in front of the
+ *  current tree if it fits there, so a shrink gets the end of the
+ *  file back, else right after it.  The current tree is left alone
+ *  until the header says the new one is complete, so a crash part way
+ *  just loses the update; its blocks are given back after.  Unless s
+ *  has the caller's keys, they come from the current tree, which is
+ *  veb->old meanwhile.  Readers wait for all of it.
+ */
+static void relocate(struct veb *veb, int height, u64 count, struct stream *s)
+{
+    struct veb *old = veb->old;
+    u64 first = first_base(veb->block_height);
+    bool front = first + tree_span(height, veb->block_height) <= veb->base;
+
+    pthread_mutex_lock(&veb->map_lock);
+    write_seq_begin(&veb->gen);
+    write_seq_begin(&veb->seq);
+
+    set_view(veb, old, veb->base, veb->height);
+    if (!s->keys)
+        stream_from(s, old, 1, tree_size(old->height) - 1, count);
+
+    /* a shorter file is only cut once the header is written */
+    veb->base = front ? first : old->base + old->span;
+    if (front)
+        veb->elements = tree_at(veb, first);
+    else
+        map_file(veb, height);
+    set_height(veb, height);
+
+    s->veb = veb;
+    s->done = count;
+    s->clear = UINT64_MAX;
+    stream_tree(s, 1, count);
+    veb->count = count;
+    write_header(veb);
+
+    if (front)
+        map_file(veb, height);
+    write_seq_end(&veb->seq);
+    write_seq_end(&veb->gen);
+    pthread_mutex_unlock(&veb->map_lock);
+
+    if (!front)
+        punch_tree(veb, old->base, old->height);
+}
+
+/*
+ *  Embiggen the tree.  Only the new, empty tree is set up here; the
+ *  keys follow a chunk at a time with later updates.
+ */
+void veb_tree_grow(struct veb *veb)
+{
+    /* a grow still under way has to finish first */
+    grow_finish(veb);
+    grow_begin(veb);
+}
+
+
+/*
+ *  Given a leaf in the tree, compute the density at its parent,
+ *  until the density is in range.
+ *
+ *  Then rebuild that subtree in place with search_key merged in,
+ *  from the log.
+ */
+static int veb_tree_rebalance(struct veb *veb, u64 bfs_num,
+                              packed_key_t *search_key)
+{
+    u64 parent;
+    int height = 2;
+    u64 occupation;
+    u64 pos[MAX_HEIGHT];
+    int d, i;
+    u32 *seq;
+
+    /*
+     * find the nearest ancestor w of v with density < target.
+     * Every node keeps the size of its subtree, so the occupation
+     * at each ancestor is its count plus one for the new element.
+     */
+    parent = bfs_parent(bfs_num);
+    d = fill_pos(veb->level_info, parent, pos);
+    occupation = veb->elements[pos[d]].count + 1;
+
+    while (density_f(occupation, height) > fill_target_f(veb, height) &&
+           height < veb->height)
+    {
+        parent = bfs_parent(parent);
+        d--;
+        occupation = veb->elements[pos[d]].count + 1;
+        height++;
+    }
+    if (height == veb->height)
+    {
+        /* table full, rebuild the table */
+        veb_tree_grow(veb);
+
+        /* and retry */
+        return -1;
+    }
+    if (veb->migrating && d < veb->chunk_depth)
+    {
+        /* the top is shared with the old tree until the grow is done */
+        grow_finish(veb);
+        return -1;
+    }
+       
+    assert(parent > 0);
+
+    /* the key is safe in the log; now redistribute */
+    veb->log[0] = *search_key;
+    begin_op(veb, VEB_OP_REBALANCE, veb->height, parent, 1, NULL);
+    seq = subtree_seq(veb, parent);
+    write_seq_begin(&veb->gen);
+    write_seq_begin(seq);
+    rebuild_subtree(veb);
+    write_seq_end(seq);
+    write_seq_end(&veb->gen);
+
+    /* the subtree gained one, and so did everything above it */
+    for (i=0; i < d; i++)
+    {
+        veb->elements[pos[i]].count++;
+        mark_dirty(veb, &veb->elements[pos[i]]);
+    }
+    veb->count++;
+    end_op(veb);
+
+    return 0;
+}
+
+/*
+ *  Put key in the empty slot at bfs, depth d, whose path is in pos.
+ */
+static void fill_slot(struct veb *veb, u64 bfs_num, u64 *pos, int d,
+                      packed_key_t *key)
+{
+    struct tree_node *node = &veb->elements[pos[d]];
+
+    begin_op(veb, VEB_OP_INSERT, veb->height, bfs_num, 0, key);
+
+    /*
+     *  Readers find the new node through its parent's link,
+     *  or by its key at the root, so those are stored last.
+     */
+    node->count = 1;
+    node->left = node->right = 0;
+    node->key.type_offset = key->type_offset;
+    __atomic_store_n(&node->key.objectid, key->objectid, __ATOMIC_RELEASE);
+
+    /* link it from the parent */
+    if (d > 0)
+    {
+        struct tree_node *parent = &veb->elements[pos[d-1]];
+
+        __atomic_store_n(bfs_is_right(bfs_num) ? &parent->right :
+                         &parent->left, make_link(veb, pos, d),
+                         __ATOMIC_RELEASE);
+    }
+
+    mark_dirty(veb, node);
+
+    /* one more node under every ancestor on the path */
+    while (d-- > 0)
+    {
+        veb->elements[pos[d]].count++;
+        mark_dirty(veb, &veb->elements[pos[d]]);
+    }
+
+    veb->count++;
+    end_op(veb);
+}
+
+/* the slot of a leaf block of this height at in-order index i */
+static inline u64 leaf_bfs(int height, u64 i)
+{
+    int z = __builtin_ctzll(i + 1);
+
+    return (1ULL << (height - 1 - z)) | ((i + 1) >> (z + 1));
+}
+
+/* and the in-order index of the slot at bfs under the block's root */
+static inline u64 leaf_index(int height, u64 bfs)
+{
+    int r = ilog2_64(bfs);
+
+    return ((2 * (bfs - (1ULL << r)) + 1) << (height - 1 - r)) - 1;
+}
+
+/*
+ *  Insert key into the leaf block it falls in when every slot on its
+ *  path is taken, the way a gapped array does: the keys between where
+ *  it goes and the nearest gap move over by one.  The slot filled is
+ *  the root of the empty subtree the gap is in, so the tree keeps its
+ *  shape, with that one node more.  For recovery this is a rebalance
+ *  of the block, with the key in the log: a crash part way rebuilds
+ *  the block, and each key is copied before its slot is overwritten,
+ *  so none is lost.  False if there is no gap in the block, or it is
+ *  still shared with the old tree of a grow.
+ */
+static bool leaf_shift(struct veb *veb, u64 bfs_num, u64 *pos,
+                       packed_key_t *key)
+{
+    int d = veb->leaf_depth;
+    int height = veb->height - d;
+    u64 n = tree_size(height);
+    u64 root = bfs_num >> height;
+    struct tree_node *slots;
+    u64 at, gap, hole, b, i;
+    u64 lo, hi;
+    bool right;
+    u32 *seq;
+
+    if (d >= veb->height || (veb->migrating && d < veb->chunk_depth))
+        return false;
+    slots = &veb->elements[pos[d] - tree_size(height - 1)];
+    if (slots[tree_size(height - 1)].count >= n)
+        return false;
+
+    /*
+     *  The key goes right before slot at, next to the leaf it reached.
+     *  The slots either side of that are the leaf and an ancestor of
+     *  it, so there are keys to shift whichever way the gap is.
+     */
+    at = leaf_index(height, (bfs_num >> 1) - (root << (height - 1)) +
+                    (1ULL << (height - 1)));
+    if (compare_key(key, &slots[at].key) > 0)
+        at++;
+
+    for (hi = at; hi < n && !node_empty(&slots[hi]); hi++)
+        ;
+    for (lo = at; lo > 0 && !node_empty(&slots[lo - 1]); lo--)
+        ;
+    right = hi < n && (lo == 0 || hi - at <= at - lo);
+    gap = right ? hi : lo - 1;
+
+    /* up to the root of the empty subtree around the gap */
+    for (b = leaf_bfs(height, gap);
+         node_empty(&slots[leaf_index(height, b >> 1)]); b >>= 1)
+        ;
+    hole = leaf_index(height, b);
+
+    veb->log[0] = *key;
+    begin_op(veb, VEB_OP_REBALANCE, veb->height, root, 1, NULL);
+    seq = subtree_seq(veb, root);
+    write_seq_begin(&veb->gen);
+    write_seq_begin(seq);
+
+    if (right)
+    {
+        slots[hole].key = slots[hi - 1].key;
+        for (i = hi - 1; i > at; i--)
+        {
+            slots[i].key = slots[i - 1].key;
+            mark_dirty(veb, &slots[i]);
+        }
+        slots[at].key = *key;
+        mark_dirty(veb, &slots[at]);
+    }
+    else
+    {
+        slots[hole].key = slots[lo].key;
+        for (i = lo; i + 1 < at; i++)
+        {
+            slots[i].key = slots[i + 1].key;
+            mark_dirty(veb, &slots[i]);
+        }
+        slots[at - 1].key = *key;
+        mark_dirty(veb, &slots[at - 1]);
+    }
+    slots[hole].count = 1;
+    slots[hole].left = slots[hole].right = 0;
+    mark_dirty(veb, &slots[hole]);
+
+    /* link the new node in, and count it up to the block's root */
+    i = leaf_index(height, b >> 1);
+    *(bfs_is_right(b) ? &slots[i].right : &slots[i].left) = 1;
+    for (b >>= 1; b; b >>= 1)
+    {
+        i = leaf_index(height, b);
+        slots[i].count++;
+        mark_dirty(veb, &slots[i]);
+    }
+    write_seq_end(seq);
+    write_seq_end(&veb->gen);
+
+    for (i=0; i < (u64) d; i++)
+    {
+        veb->elements[pos[i]].count++;
+        mark_dirty(veb, &veb->elements[pos[i]]);
+    }
+    veb->count++;
+    end_op(veb);
+    return true;
+}
+
+/*
+ *  Search through the tree to the first unoccupied node, then
+ *  add the value.  If the new depth is greater than the height bound,
+ *  then the tree must be rebalanced.
+ */
+static int insert_packed(struct veb *veb, packed_key_t *search_key)
+{
+    int res;
     int d;
     int cmp;
-    int bfs_num = 1;
-    int pos[MAX_HEIGHT];
+    u64 bfs_num = 1;
+    u64 pos[MAX_HEIGHT];
     struct level_info *l = veb->level_info;
 
     pos[0] = 0;
@@ -660,7 +1548,7 @@ int veb_tree_insert(struct veb *veb, btrfs_key_t *search_key)
 #ifdef TEST_BFS
         struct tree_node *node = node_at(veb, bfs_num);
 #else
-        pos[d] = pos[l[d].subtree_depth] + l[d].top_size +
+        pos[d] = pos[l[d].subtree_depth] + l[d].top_span +
             (bfs_num & l[d].top_size) * (l[d].bottom_size);
 
         struct tree_node *node = &veb->elements[pos[d]];
@@ -668,13 +1556,16 @@ int veb_tree_insert(struct veb *veb, btrfs_key_t *search_key)
 
         if (node_empty(node))
         {
-            memcpy(&node->key, search_key, sizeof(*search_key));
-            veb->count++;
+            fill_slot(veb, bfs_num, pos, d, search_key);
             return 0;
         }
 
         cmp = compare_key(search_key, &node->key);
 
+        /*
+         *  Branches on purpose: the next slot's position is worked out
+         *  from bfs_num, and guessing the way lets its load start early.
+         */
         if (cmp < 0)
             bfs_num = bfs_left(bfs_num);
         else if (cmp > 0)
@@ -682,144 +1573,1757 @@ int veb_tree_insert(struct veb *veb, btrfs_key_t *search_key)
         else
             return 0;
     }
-    /* no space, rebalance and insert */
+    /* no space: shift over inside the leaf block, or rebalance */
+    if (leaf_shift(veb, bfs_num, pos, search_key))
+        return 0;
     res = veb_tree_rebalance(veb, bfs_parent(bfs_num), search_key);
 
-    /* if tree was resized, start the search over */
+    /* if tree was resized, start the search over, in a moved chunk */
     if (res == -1)
-        return veb_tree_insert(veb, search_key);
+    {
+        if (veb->migrating)
+            grow_prepare(veb, search_key);
+        return insert_packed(veb, search_key);
+    }
 
     return 0;
 }
 
-#ifdef PTR_SEARCH
-struct tree_node *veb_tree_search(struct veb *veb, btrfs_key_t *search_key)
+int veb_tree_insert(struct veb *veb, btrfs_key_t *search_key)
 {
-    int d;
-    int cmp;
-    struct tree_node *node = &veb->elements[0];
+    packed_key_t key;
 
-    for (d=0; d < veb->height; d++)
+    if (!key_fits(search_key))
+        return -EINVAL;
+
+    key = pack_key(search_key);
+    if (veb->migrating)
+        grow_prepare(veb, &key);
+    return insert_packed(veb, &key);
+}
+
+/*
+ *  Rebuild the subtree at bfs, depth d, without key, relinking it
+ *  from its parent in case it is left empty.  Nodes never move on
+ *  their own in the layout, so this is how every delete is done:
+ *  for a leaf it empties one slot, for an inner node it redistributes
+ *  what is under it, which for most nodes is only a few keys.
+ */
+static void delete_rebalance(struct veb *veb, u64 bfs, u64 *pos, int d,
+                             packed_key_t *key)
+{
+    u64 count;
+    int i;
+    u32 *seq;
+
+    begin_op(veb, VEB_OP_PRUNE, veb->height, bfs, 0, key);
+    seq = subtree_seq(veb, bfs);
+    write_seq_begin(&veb->gen);
+    write_seq_begin(seq);
+    count = rebuild_subtree(veb);
+    if (d > 0 && count == 0)
     {
-        cmp = compare_key(search_key, &node->key);
+        struct tree_node *parent = &veb->elements[pos[d-1]];
 
-        if (cmp < 0)
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else
-            return node;
+        *(bfs_is_right(bfs) ? &parent->right : &parent->left) = 0;
+        mark_dirty(veb, parent);
     }
-    return NULL;
+    write_seq_end(seq);
+    write_seq_end(&veb->gen);
+
+    /* the subtree lost one, and so did everything above it */
+    for (i=0; i < d; i++)
+    {
+        veb->elements[pos[i]].count--;
+        mark_dirty(veb, &veb->elements[pos[i]]);
+    }
+    veb->count--;
+    end_op(veb);
 }
 
-#else
 /*
- *  Search down the tree to find the leaf that points to the segment
- *  containing search_key.  The internal node is returned.
+ *  Find a leaf holding the in-order neighbour of the node at pos,
+ *  bfs: the successor, or failing that the predecessor.  Returns its
+ *  bfs and position, or 0 if neither is a leaf.
  */
-struct tree_node *veb_tree_search(struct veb *veb, btrfs_key_t *search_key)
+static u64 neighbour_leaf(struct veb *veb, u64 bfs, int d, u64 pos,
+                          u64 *leaf_pos)
 {
-    int d;
-    int cmp;
-    int bfs_num = 1;
-    int pos[MAX_HEIGHT];
+    int i;
+
+    for (i=0; i < 2; i++)
+    {
+        bool right = i == 0;
+        struct tree_node *node = &veb->elements[pos];
+        u64 b = bfs, p = pos;
+        int bd = d;
+        u32 link = right ? node->right : node->left;
+
+        if (!link)
+            continue;
+
+        b = right ? bfs_right(b) : bfs_left(b);
+        p = follow_link(veb, p, link, b, ++bd);
+        node = &veb->elements[p];
+        while ((link = right ? node->left : node->right))
+        {
+            b = right ? bfs_left(b) : bfs_right(b);
+            p = follow_link(veb, p, link, b, ++bd);
+            node = &veb->elements[p];
+        }
+
+        if (!node->left && !node->right)
+        {
+            *leaf_pos = p;
+            return b;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  The cheap delete: move the key of a neighbouring leaf into the
+ *  node at pos[d] and empty the leaf, or just empty the node if it
+ *  is a leaf itself.  Returns false if it has children but neither
+ *  neighbour is a leaf.
+ */
+static bool delete_at_leaf(struct veb *veb, u64 bfs, u64 *pos, int d,
+                           packed_key_t *key)
+{
+    struct tree_node *node = &veb->elements[pos[d]];
+    struct tree_node *leaf = node;
+    u64 slot = bfs, leaf_pos = pos[d];
+    u64 lpos[MAX_HEIGHT];
+    int ld, i;
+    u32 *seq;
+
+    if (node->left || node->right)
+    {
+        slot = neighbour_leaf(veb, bfs, d, pos[d], &leaf_pos);
+        if (!slot)
+            return false;
+        leaf = &veb->elements[leaf_pos];
+    }
+    ld = fill_pos(veb->level_info, slot, lpos);
+
+    /* begin_op has no room for the slot, and must store op last */
+    veb->super->intent.slot = slot;
+    begin_op(veb, VEB_OP_DELETE, veb->height, bfs, 0, key);
+    seq = subtree_seq(veb, bfs);
+    write_seq_begin(&veb->gen);
+    write_seq_begin(seq);
+    if (leaf != node)
+    {
+        node->key = leaf->key;
+        mark_dirty(veb, node);
+    }
+    leaf->key.objectid = NULL_KEY;
+    leaf->count = 0;
+    mark_dirty(veb, leaf);
+    if (ld > 0)
+    {
+        struct tree_node *parent = &veb->elements[lpos[ld-1]];
+
+        *(bfs_is_right(slot) ? &parent->right : &parent->left) = 0;
+    }
+    write_seq_end(seq);
+    write_seq_end(&veb->gen);
+
+    for (i=0; i < ld; i++)
+    {
+        veb->elements[lpos[i]].count--;
+        mark_dirty(veb, &veb->elements[lpos[i]]);
+    }
+    veb->count--;
+    end_op(veb);
+    return true;
+}
+
+/*
+ *  Remove key.  Going up from its node, the first subtree that is
+ *  still dense enough without it is rebuilt, so sparse subtrees are
+ *  refilled from their neighbours; when that is the node's own
+ *  subtree, a neighbouring leaf usually just takes its place.  If
+ *  even the root is too sparse, the tree is rebuilt one level lower
+ *  and the file cut in half.  Returns 0, -ENOENT if key is not in
+ *  the tree, or -EINVAL if its offset doesn't fit.
+ */
+int veb_tree_delete(struct veb *veb, btrfs_key_t *search_key)
+{
+    packed_key_t key;
     struct level_info *l = veb->level_info;
+    struct tree_node *node = NULL;
+    u64 pos[MAX_HEIGHT];
+    u64 bfs_num = 1;
+    int d, height;
+    int cmp;
+
+    if (!key_fits(search_key))
+        return -EINVAL;
+    key = pack_key(search_key);
+
+    if (veb->migrating)
+        grow_prepare(veb, &key);
 
     pos[0] = 0;
     for (d=0; d < veb->height; d++)
     {
-#ifdef TEST_BFS
-        struct tree_node *node = node_at(veb, bfs_num);
-#else
-        pos[d] = pos[l[d].subtree_depth] + l[d].top_size +
+        pos[d] = pos[l[d].subtree_depth] + l[d].top_span +
             (bfs_num & l[d].top_size) * (l[d].bottom_size);
+        node = &veb->elements[pos[d]];
 
-        struct tree_node *node = &veb->elements[pos[d]];
-#endif
+        if (node_empty(node))
+            return -ENOENT;
 
-        cmp = compare_key(search_key, &node->key);
+        cmp = compare_key(&key, &node->key);
+        if (cmp == 0)
+            break;
 
-        if (cmp < 0)
-            bfs_num = bfs_left(bfs_num);
-        else if (cmp > 0)
-            bfs_num = bfs_right(bfs_num);
-        else
-            return node;
+        bfs_num = bfs_child(bfs_num, cmp > 0);
+    }
+    if (d == veb->height)
+        return -ENOENT;
+    if (veb->migrating && d < veb->chunk_depth)
+    {
+        /* the top is shared with the old tree until the grow is done */
+        grow_finish(veb);
+        return veb_tree_delete(veb, search_key);
+    }
+
+    /*
+     *  The new tree of a grow is sparse until the old one is moved
+     *  over, so it isn't held to the lower bounds until then.
+     */
+    height = veb->height - d;
+    if ((veb->migrating || density_f(node->count - 1, height) >=
+         lower_density_f(veb, height)) &&
+        delete_at_leaf(veb, bfs_num, pos, d, &key))
+        return 0;
 
+    while (!veb->migrating && d > 0 && density_f(node->count - 1, height) <
+           lower_density_f(veb, height))
+    {
+        d--;
+        height++;
+        bfs_num = bfs_parent(bfs_num);
+        node = &veb->elements[pos[d]];
     }
-    return NULL;
+
+    if (!veb->migrating && d == 0 && veb->height > 2 &&
+        density_f(node->count - 1, height) < lower_density_f(veb, height))
+    {
+        struct stream s = { .drop = &key };
+
+        relocate(veb, veb->height - 1, veb->count - 1, &s);
+        return 0;
+    }
+
+    delete_rebalance(veb, bfs_num, pos, d, &key);
+    return 0;
 }
-#endif
 
 /*
- * Create a new complete VEB layout tree capable of storing at
- * least nitems in the leaves.  The height of the tree will be
- * lg 2*nitems.
+ *  Batched insert.  The keys are sorted and split at each node on
+ *  the way down, so every run ends up at the subtree it falls in.
+ *  A run is merged at the lowest subtree whose density can take it,
+ *  with one rebuild for the whole run, instead of a rebalance for
+ *  almost every key.
  */
-struct veb *veb_tree_new(int nitems, bool clear)
+struct batch_op {
+    u64 bfs;
+    u64 lo, hi;             /* the run, as a range of the sorted keys */
+};
+
+struct batch {
+    packed_key_t *keys;
+    struct batch_op *ops;
+    u64 nops;
+    u64 pos[MAX_HEIGHT];
+};
+
+static int compare_packed(const void *a, const void *b)
 {
-    int height = ilog2(2 * nitems) + 1;
-    int nodes = 1 << height;
+    return compare_key((packed_key_t *) a, (packed_key_t *) b);
+}
 
-    struct veb *veb = malloc(sizeof(*veb));
-    struct tree_node *elements;
-    struct tree_node *scratch;
+/* can a subtree of this height hold count keys? */
+static inline bool batch_fits(struct veb *veb, u64 count, int height)
+{
+    return count <= tree_size(height) &&
+           density_f(count, height) <= fill_target_f(veb, height);
+}
 
-    struct level_info *li;
+/*
+ *  Decide where the run keys[lo, hi) goes in the subtree at bfs.
+ *  Children are planned first; if either can't take its part, their
+ *  plans are dropped and the run is merged here, so the ops left in
+ *  the plan are always disjoint subtrees.  False if even this
+ *  subtree is too full.
+ */
+static bool batch_plan(struct veb *veb, struct batch *b, u64 bfs, int d,
+                       u64 lo, u64 hi)
+{
+    struct tree_node *node;
+    int height = veb->height - d;
+    u64 nops = b->nops;
+    u64 mid, end;
 
-    /* printf("Alloced %d nodes\n", nodes); */
+    if (lo == hi)
+        return true;
+    if (height == 0)
+        return false;
 
-    if (!clear) {
-        load_veb_info(veb);
-        height = veb->height;
-        nodes = 1 << height;
+    node = node_at_pos(veb, bfs, b->pos, d);
+    if (node_empty(node))
+    {
+        /* a single key just fills the slot, as a plain insert would */
+        if (hi - lo > 1 && !batch_fits(veb, hi - lo, height))
+            return false;
+    }
+    else
+    {
+        for (mid = lo; mid < hi &&
+             compare_key(&b->keys[mid], &node->key) < 0; mid++)
+            ;
+        end = mid;
+        if (end < hi && compare_key(&b->keys[end], &node->key) == 0)
+            end++;
+
+        if (batch_plan(veb, b, bfs_left(bfs), d + 1, lo, mid) &&
+            batch_plan(veb, b, bfs_right(bfs), d + 1, end, hi))
+            return true;
+
+        b->nops = nops;
+        if (!batch_fits(veb, node->count + hi - lo, height))
+            return false;
     }
 
-    elements = setup_mmap(sizeof(*elements) * nodes, clear);
-    scratch = malloc(sizeof(*scratch) * nodes);
-    li = malloc(sizeof(*li) * height);
-
-    /* density range from 0.5 to 1 */
-    veb->min_density = 0x08000;
-    veb->max_density = 0x10000;
-    compute_level_info(li, height);
-
-    veb->level_info = li;
-    veb->elements = elements;
-    veb->scratch = scratch;
-    veb->height = height;
-    veb->count = 0;
-    veb->iter_pos[0] = 0;
-
-    return veb;
+    b->ops[b->nops++] = (struct batch_op) { bfs, lo, hi };
+    return true;
 }
 
-void pointerize(struct veb *veb)
+/*
+ *  Merge one planned run into its subtree.  A lone key for an empty
+ *  slot is a plain insert.  Anything else is a rebalance that adds
+ *  more than one key: the run goes in the log and is recovered the
+ *  same way.  The subtree may have been empty, in which case the
+ *  parent is linked to it last.
+ */
+static void batch_apply(struct veb *veb, struct batch *b,
+                        struct batch_op *op)
 {
+    u64 pos[MAX_HEIGHT];
+    int d = fill_pos(veb->level_info, op->bfs, pos);
+    struct tree_node *node = &veb->elements[pos[d]];
+    u64 added = -(u64) node->count;
+    u64 n = op->hi - op->lo;
     int i;
+    u32 *seq;
+
+    if (node_empty(node) && n == 1)
+    {
+        fill_slot(veb, op->bfs, pos, d, &b->keys[op->lo]);
+        return;
+    }
 
-    for (i=1; i < (1 << veb->height); i++)
+    memcpy(veb->log, &b->keys[op->lo], n * sizeof(*veb->log));
+    begin_op(veb, VEB_OP_REBALANCE, veb->height, op->bfs, n, NULL);
+    seq = subtree_seq(veb, op->bfs);
+    write_seq_begin(&veb->gen);
+    write_seq_begin(seq);
+    added += rebuild_subtree(veb);
+    write_seq_end(seq);
+    write_seq_end(&veb->gen);
+
+    if (d > 0)
     {
-        struct tree_node *node = node_at(veb, i);
+        struct tree_node *parent = &veb->elements[pos[d-1]];
 
-        if (!node_empty(node))
-        {
-            if (node_valid(veb, bfs_left(i)))
-                node->left = node_at(veb, bfs_left(i));
+        __atomic_store_n(bfs_is_right(op->bfs) ? &parent->right :
+                         &parent->left, make_link(veb, pos, d),
+                         __ATOMIC_RELEASE);
+    }
 
-            if (node_valid(veb, bfs_right(i)))
-                node->right = node_at(veb, bfs_right(i));
-        }
+    for (i=0; i < d; i++)
+    {
+        veb->elements[pos[i]].count += added;
+        mark_dirty(veb, &veb->elements[pos[i]]);
     }
+    veb->count += added;
+    end_op(veb);
 }
 
-void veb_tree_free(struct veb *veb)
+/*
+ *  Insert n keys in one go.  keys is left as it was.  Returns the
+ *  number of keys that were not already in the tree.  If any offset
+ *  doesn't fit, nothing is inserted and errno is EINVAL.
+ */
+u64 veb_tree_insert_batch(struct veb *veb, btrfs_key_t *keys, u64 n)
 {
-    save_veb_info(veb);
-    release_memory(veb->elements);
+    struct batch b;
+    u64 before = veb->count;
+    bool planned;
+    u64 i, j, chunk;
+
+    if (n == 0)
+        return 0;
 
-    free(veb->scratch);
+    for (i=0; i < n; i++)
+    {
+        if (!key_fits(&keys[i]))
+        {
+            errno = EINVAL;
+            return 0;
+        }
+    }
+
+    /* kept from one batch to the next, so only a bigger one allocates */
+    if (n > veb->batch_cap)
+    {
+        u64 cap = max(n, 2 * veb->batch_cap);
+
+        free(veb->batch_buf);
+        veb->batch_buf = malloc(cap * (sizeof(*b.keys) + sizeof(*b.ops)));
+        if (!veb->batch_buf)
+            die("no memory for batch");
+        veb->batch_cap = cap;
+        veb->allocs++;
+    }
+    b.keys = veb->batch_buf;
+    b.ops = (struct batch_op *) (b.keys + n);
+
+    for (i=0; i < n; i++)
+        b.keys[i] = pack_key(&keys[i]);
+    qsort(b.keys, n, sizeof(*b.keys), compare_packed);
+    for (i=j=1; i < n; i++)
+        if (compare_key(&b.keys[i], &b.keys[j-1]))
+            b.keys[j++] = b.keys[i];
+    n = j;
+
+    if (veb->migrating)
+    {
+        grow_step(veb);
+        for (i=0; i < n && veb->migrating; i++)
+            if ((chunk = old_chunk(veb, &b.keys[i])))
+                move_chunk(veb, chunk);
+    }
+
+    b.nops = 0;
+    b.pos[0] = 0;
+    planned = batch_plan(veb, &b, 1, 0, 0, n);
+    for (i=0; planned && veb->migrating && i < b.nops; i++)
+        if (ilog2_64(b.ops[i].bfs) < veb->chunk_depth)
+            planned = false;
+    if (!planned && veb->migrating)
+    {
+        /* the top has to be the new tree's own to merge across it */
+        grow_finish(veb);
+        b.nops = 0;
+        planned = batch_plan(veb, &b, 1, 0, 0, n);
+    }
+
+    while (!planned)
+    {
+        /* too much for the whole tree: grow until it fits */
+        veb_tree_grow(veb);
+        grow_finish(veb);
+        b.nops = 0;
+        planned = batch_plan(veb, &b, 1, 0, 0, n);
+    }
+
+    for (i=0; i < b.nops; i++)
+        batch_apply(veb, &b, &b.ops[i]);
+
+    return veb->count - before;
+}
+
+/*
+ *  Incremental grow.  The tree of height H+1 is laid out in the file
+ *  right after the old one, which stays mapped read-only as veb->old.
+ *  The top of the new tree's vEB split is copied over as it is, so
+ *  the subtrees below it, the chunks, cover the same key ranges in
+ *  both trees, with one more level in the new one, and each is one
+ *  contiguous block of it.  Each update then moves one chunk into
+ *  its place, so no single insert pays for copying the whole tree,
+ *  only for about its square root.  Readers look in the new tree
+ *  first, then the old.
+ *
+ *  Apart from the top, a key is in exactly one of the trees, except
+ *  while its chunk is being moved: then it is in both until the old
+ *  subtree is unlinked.  Updates only touch chunks that have moved;
+ *  one that needs to rebalance across the top finishes the grow.
+ *  The header records the chunk being moved, so it can be moved
+ *  again after a crash.
+ */
+/* set up veb->old as the tree of the given height at base */
+static void grow_setup(struct veb *veb, u64 base, int height)
+{
+    set_view(veb, veb->old, base, height);
+    veb->chunk_depth = split_height(height + 1);
+    veb->migrating = true;
+}
+
+/*
+ *  Copy the top of the old tree, empty slots too, and return how many
+ *  keys that was.  Bottom up, so each node's children are done first.
+ */
+static u64 copy_top(struct veb *veb)
+{
+    struct veb *old = veb->old;
+    u64 pos[MAX_HEIGHT], child[MAX_HEIGHT];
+    struct tree_node *from, *to;
+    u64 bfs;
+    int d, i;
+
+    for (bfs = tree_size(veb->chunk_depth); bfs >= 1; bfs--)
+    {
+        d = fill_pos(old->level_info, bfs, pos);
+        from = &old->elements[pos[d]];
+        fill_pos(veb->level_info, bfs, pos);
+        to = &veb->elements[pos[d]];
+
+        memset(to, 0, sizeof(*to));
+        if (!node_empty(from))
+        {
+            to->key = from->key;
+            to->count = 1;
+        }
+        for (i=0; i < 2 && d + 1 < veb->chunk_depth && to->count; i++)
+        {
+            fill_pos(veb->level_info, 2 * bfs + i, child);
+            if (node_empty(&veb->elements[child[d+1]]))
+                continue;
+
+            to->count += veb->elements[child[d+1]].count;
+            if (i)
+                to->right = make_link(veb, child, d + 1);
+            else
+                to->left = make_link(veb, child, d + 1);
+        }
+        mark_dirty(veb, to);
+    }
+    return veb->elements[0].count;
+}
+
+static void grow_begin(struct veb *veb)
+{
+    int height = veb->height;
+
+    pthread_mutex_lock(&veb->map_lock);
+    write_seq_begin(&veb->gen);
+    write_seq_begin(&veb->seq);
+    grow_setup(veb, veb->base, height);
+    veb->base += veb->old->span;
+    map_file(veb, height + 1);
+    set_height(veb, height + 1);
+    veb->old_count = veb->count - copy_top(veb);
+    veb->migrated = 0;
+    veb->moving = 0;
+    write_seq_end(&veb->seq);
+    write_seq_end(&veb->gen);
+    write_header(veb);
+    pthread_mutex_unlock(&veb->map_lock);
+}
+
+/*
+ *  The chunk of the old tree that key falls in, or 0 if that has
+ *  been moved already or key is in the top.
+ */
+static u64 old_chunk(struct veb *veb, packed_key_t *key)
+{
+    struct veb *old = veb->old;
+    struct tree_node *node;
+    u64 pos[MAX_HEIGHT];
+    u64 bfs = 1;
+    int d;
+    int cmp;
+
+    pos[0] = 0;
+    for (d=0; d < veb->chunk_depth; d++)
+    {
+        node = node_at_pos(old, bfs, pos, d);
+        if (node_empty(node))
+            return 0;
+        cmp = compare_key(key, &node->key);
+        if (cmp == 0)
+            return 0;
+        bfs = bfs_child(bfs, cmp > 0);
+    }
+    return node_empty(node_at_pos(old, bfs, pos, d)) ? 0 : bfs;
+}
+
+/*
+ *  Stream the old subtree at bfs into the empty one at the same bfs
+ *  in the new tree, then unlink it.  The old subtree is only emptied
+ *  at its root, which is what says it has moved: until then a redo
+ *  after a crash just streams it over again.  The rest of its slots
+ *  go when the grow is done.
+ */
+static void move_chunk(struct veb *veb, u64 bfs)
+{
+    struct veb *old = veb->old;
+    u64 chunks = 1ULL << veb->chunk_depth;
+    struct stream s = { .veb = veb, .done = UINT64_MAX, .clear = UINT64_MAX };
+    u64 pos[MAX_HEIGHT];
+    struct tree_node *root;
+    u64 count;
+    int d;
+    u32 *seq;
+
+    veb->moving = bfs;
+    publish_header(veb);
+
+    d = fill_pos(old->level_info, bfs, pos);
+    root = &old->elements[pos[d]];
+    if (!node_empty(root))
+    {
+        count = root->count;
+        stream_from(&s, old, bfs, tree_size(old->height - d) - 1, count);
+        seq = subtree_seq(veb, bfs);
+        write_seq_begin(&veb->gen);
+        write_seq_begin(seq);
+        stream_tree(&s, bfs, count);
+        write_seq_end(seq);
+        write_seq_end(&veb->gen);
+
+        /* only now do the keys leave the old tree */
+        write_seq_begin(&veb->gen);
+        write_seq_begin(&veb->seq);
+        repair_path(veb, bfs);
+        memset(root, 0, sizeof(*root));
+        mark_dirty(old, root);
+        if (d > 0)
+        {
+            struct tree_node *parent = &old->elements[pos[d-1]];
+
+            if (bfs_is_right(bfs))
+                parent->right = 0;
+            else
+                parent->left = 0;
+            mark_dirty(old, parent);
+        }
+        write_seq_end(&veb->seq);
+        write_seq_end(&veb->gen);
+
+        /* repair_path counted the new tree afresh */
+        veb->old_count -= count;
+        veb->count += veb->old_count;
+    }
+
+    veb->moving = 0;
+    if (bfs != chunks + veb->migrated)
+    {
+        publish_header(veb);
+        return;
+    }
+    veb->migrated++;
+    publish_header(veb);
+    if (veb->migrated == chunks)
+        grow_end(veb);
+}
+
+/* all chunks are over: give the old tree's blocks back */
+static void grow_end(struct veb *veb)
+{
+    struct veb *old = veb->old;
+
+    write_seq_begin(&veb->gen);
+    write_seq_begin(&veb->seq);
+    veb->migrating = false;
+    write_seq_end(&veb->seq);
+    write_seq_end(&veb->gen);
+
+    punch_tree(veb, old->base, old->height);
+    veb->migrated = 0;
+    publish_header(veb);
+}
+
+/* one chunk's worth of migration, called once per update */
+static void grow_step(struct veb *veb)
+{
+    if (veb->migrating)
+        move_chunk(veb, (1ULL << veb->chunk_depth) + veb->migrated);
+}
+
+/*
+ *  Before an update, besides the step, bring over the chunk its key
+ *  falls in.  Only a moved chunk's subtree in the new tree is ever
+ *  updated, so there is always room to move it in.
+ */
+static void grow_prepare(struct veb *veb, packed_key_t *key)
+{
+    u64 bfs;
+
+    grow_step(veb);
+    if (veb->migrating && (bfs = old_chunk(veb, key)))
+        move_chunk(veb, bfs);
+}
+
+static void grow_finish(struct veb *veb)
+{
+    while (veb->migrating)
+        grow_step(veb);
+}
+
+/*
+ *  The old tree's counts go stale as chunks leave, so walk it.  The
+ *  top is in the new tree already and isn't counted.
+ */
+static u64 old_count(struct veb *veb)
+{
+    u64 pos[MAX_HEIGHT];
+    u64 bfs = bfs_first(veb->old, 1, pos);
+    u64 count = 0;
+
+    while (bfs)
+    {
+        count += ilog2_64(bfs) >= veb->chunk_depth;
+        bfs = bfs_next(veb->old, bfs, 1, pos);
+    }
+    return count;
+}
+
+/* pick up a migration the header says was going on */
+static void grow_resume(struct veb *veb)
+{
+    if (veb->moving)
+        move_chunk(veb, veb->moving);
+    if (veb->migrating && veb->migrated == (1ULL << veb->chunk_depth))
+        grow_end(veb);
+}
+
+/*
+ *  Readers run concurrently with the writer.  They check seq around
+ *  the whole walk, and the sequence count of the bottom block as
+ *  they enter it; whatever they read under a count that then moved
+ *  is thrown away.  Until then it may be garbage, so every step is
+ *  kept inside the part of the tree that is mapped.
+ */
+static inline void enter_block(struct veb *veb, int top, u64 bfs,
+                               u32 **bseq, u32 *bs)
+{
+    if (top > 0)
+    {
+        *bseq = block_seq(veb, top, bfs);
+        *bs = read_seq_begin(*bseq);
+    }
+}
+
+/*
+ *  A lookup's leaf block: the depth it is scanned from, or height for
+ *  none.  One above the bottom blocks would need all their sequence
+ *  counts, so those are walked like the rest of the tree.
+ */
+static inline int search_leaf(struct veb *veb)
+{
+    int top = veb->top_height;
+
+    if (veb->leaf_depth < top)
+        return veb->height;
+    return veb->leaf_depth;
+}
+
+/*
+ *  Look for key in the leaf block whose root is at pos, depth d.
+ *  Every slot of it is compared, gaps and all, so there is no chain
+ *  of loads to wait on and no branch to mispredict.
+ */
+static inline struct tree_node *leaf_find(struct veb *veb, u64 pos, int d,
+                                          packed_key_t *key, u64 limit)
+{
+    int height = veb->height - d;
+    u64 start = pos - tree_size(height - 1);
+    u64 n = tree_size(height);
+    __m128i k = _mm_loadu_si128((__m128i *) key);
+    struct tree_node *slots, *found = NULL;
+    u64 i;
+
+    if (start > limit - n || key->objectid == NULL_KEY)
+        return NULL;
+
+    slots = &veb->elements[start];
+    for (i=0; i < n; i++)
+    {
+        __m128i x = _mm_loadu_si128((__m128i *) &slots[i].key);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, k)) == 0xffff)
+            found = &slots[i];
+    }
+    return found;
+}
+
+#ifdef PTR_SEARCH
+/*
+ *  Follow the child links down from the root.  They are kept up to
+ *  date by every insert, so no extra pass is needed before searching.
+ */
+static struct tree_node *search_once(struct veb *veb, packed_key_t *key,
+                                     u32 **bseq, u32 *bs)
+{
+    int height = veb->height;
+    int top = veb->top_height;
+    int leaf = search_leaf(veb);
+    u64 limit = veb->span;
+    u64 pos = 0;
+    u64 bfs = 1;
+    int d;
+    int cmp;
+    bool right;
+    u32 link;
+    struct tree_node *node = &veb->elements[0];
+
+    if (node_empty(node))
+        return NULL;
+
+    for (d=0; d < height; d++)
+    {
+        if (d == leaf)
+            return leaf_find(veb, pos, d, key, limit);
+
+        cmp = compare_key(key, &node->key);
+        if (cmp == 0)
+            return node;
+
+        /* which way to go is data, not control flow */
+        right = cmp > 0;
+        link = right ? node->right : node->left;
+        if (!link)
+            break;
+
+        bfs = bfs_child(bfs, right);
+        if (d + 1 == top)
+            enter_block(veb, top, bfs, bseq, bs);
+        pos = follow_link(veb, pos, link, bfs, d + 1);
+        if (pos >= limit)
+            break;
+        node = &veb->elements[pos];
+    }
+    return NULL;
+}
+
+#else
+/*
+ *  Search down the tree to find the leaf that points to the segment
+ *  containing search_key.  The internal node is returned.
+ */
+static struct tree_node *search_once(struct veb *veb, packed_key_t *key,
+                                     u32 **bseq, u32 *bs)
+{
+    int height = veb->height;
+    int top = veb->top_height;
+    int leaf = search_leaf(veb);
+    u64 limit = veb->span;
+    int d;
+    int cmp;
+    u64 bfs_num = 1;
+    u64 pos[MAX_HEIGHT];
+    struct level_info *l = veb->level_info;
+
+    pos[0] = 0;
+    for (d=0; d < height; d++)
+    {
+        if (d == top)
+            enter_block(veb, top, bfs_num, bseq, bs);
+#ifdef TEST_BFS
+        struct tree_node *node = node_at(veb, bfs_num);
+#else
+        pos[d] = pos[l[d].subtree_depth] + l[d].top_span +
+            (bfs_num & l[d].top_size) * (l[d].bottom_size);
+        if (pos[d] >= limit)
+            break;
+        if (d == leaf)
+            return leaf_find(veb, pos[d], d, key, limit);
+
+        struct tree_node *node = &veb->elements[pos[d]];
+#endif
+
+        cmp = compare_key(key, &node->key);
+        if (cmp == 0)
+            return node;
+
+        bfs_num = bfs_child(bfs_num, cmp > 0);
+    }
+    return NULL;
+}
+#endif
+
+/*
+ *  Find key, in the old tree too while growing, and copy what the
+ *  node holds to *copy, if given, under the same sequence counts.
+ */
+static struct tree_node *search_seq(struct veb *veb, packed_key_t *key,
+                                    packed_key_t *copy)
+{
+    struct tree_node *node;
+    u32 *bseq;
+    u32 s, bs = 0;
+
+    do {
+        bseq = NULL;
+        s = read_seq_begin(&veb->seq);
+        node = veb->search(veb, key, &bseq, &bs);
+        if (!node && veb->migrating)
+        {
+            /* the old tree only changes under seq */
+            u32 *obseq = NULL;
+            u32 obs;
+
+            node = veb->old->search(veb->old, key, &obseq, &obs);
+        }
+        if (node && copy)
+            *copy = node->key;
+    } while (read_seq_retry(&veb->seq, s) ||
+             (bseq && read_seq_retry(bseq, bs)));
+
+    return node;
+}
+
+/*
+ *  The node is only stable until the writer's next rebalance; use
+ *  veb_tree_lookup() if the tree is being written concurrently.
+ */
+struct tree_node *veb_tree_search(struct veb *veb, btrfs_key_t *search_key)
+{
+    packed_key_t key;
+
+    if (!key_fits(search_key))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    key = pack_key(search_key);
+    return search_seq(veb, &key, NULL);
+}
+
+/*
+ *  Look key up and copy the key found to *out.  The copy is taken
+ *  under the same sequence counts as the walk, so unlike the node
+ *  veb_tree_search() returns, it holds with a writer running.
+ */
+bool veb_tree_lookup(struct veb *veb, btrfs_key_t *search_key,
+                     btrfs_key_t *out)
+{
+    packed_key_t key, found;
+
+    if (!key_fits(search_key))
+    {
+        errno = EINVAL;
+        return false;
+    }
+    key = pack_key(search_key);
+    if (!search_seq(veb, &key, &found))
+        return false;
+    unpack_key(&found, out);
+    return true;
+}
+
+/*
+ *  Cursors follow the child links, which are kept for every node
+ *  whatever the search flavour, and the path kept in the cursor.
+ *  Each move runs under gen and is redone if a rebalance overlapped
+ *  it; a cursor whose path went stale finds its key again first.
+ */
+static inline struct tree_node *cursor_node(struct veb_cursor *c)
+{
+    return c->bfs ? &c->tree->elements[c->pos[c->depth]] : NULL;
+}
+
+/*
+ *  Step down from the current node to its left or right child, or
+ *  as far as possible in that direction when all is set.
+ */
+static void cursor_down(struct veb_cursor *c, bool right, bool all)
+{
+    struct tree_node *node = cursor_node(c);
+    int height = c->tree->height;
+    u64 limit = c->tree->span;
+    u64 bfs, pos;
+    u32 link;
+
+    while ((link = right ? node->right : node->left) &&
+           c->depth + 1 < height)
+    {
+        bfs = right ? bfs_right(c->bfs) : bfs_left(c->bfs);
+        pos = follow_link(c->tree, c->pos[c->depth], link, bfs,
+                          c->depth + 1);
+        if (pos >= limit)
+            break;
+
+        c->pos[++c->depth] = pos;
+        c->bfs = bfs;
+        node = &c->tree->elements[pos];
+
+        if (!all)
+            break;
+    }
+}
+
+/*
+ *  Land on the node where the walk resumes and start fetching the
+ *  subtree it will descend into next.
+ */
+static inline struct tree_node *cursor_land(struct veb_cursor *c, bool fwd)
+{
+    struct tree_node *node = cursor_node(c);
+    u64 bfs;
+    u32 link;
+
+    if (node)
+    {
+        link = fwd ? node->right : node->left;
+        bfs = fwd ? bfs_right(c->bfs) : bfs_left(c->bfs);
+        if (link)
+            __builtin_prefetch(&c->tree->elements[
+                follow_link(c->tree, c->pos[c->depth], link, bfs,
+                            c->depth + 1)]);
+    }
+    return node;
+}
+
+static void cursor_start(struct veb *veb, struct veb_cursor *c)
+{
+    c->tree = veb;
+    c->depth = 0;
+    c->pos[0] = 0;
+    c->bfs = node_empty(&veb->elements[0]) ? 0 : 1;
+}
+
+/* position c at the first key >= k */
+static struct tree_node *cursor_seek(struct veb *veb, packed_key_t *k,
+                                     struct veb_cursor *c)
+{
+    struct tree_node *node;
+    int height = veb->height;
+    u64 limit = veb->span;
+    u64 best = 0, bfs, pos;
+    int best_depth = 0;
+    u32 link;
+
+    cursor_start(veb, c);
+    if (!c->bfs)
+        return NULL;
+
+    node = &veb->elements[0];
+    for (;;)
+    {
+        bool right = compare_key(k, &node->key) > 0;
+
+        /* every node we turn left at is an upper bound so far */
+        best = right ? best : c->bfs;
+        best_depth = right ? best_depth : c->depth;
+
+        link = right ? node->right : node->left;
+        if (!link || c->depth + 1 >= height)
+            break;
+
+        bfs = bfs_child(c->bfs, right);
+        pos = follow_link(veb, c->pos[c->depth], link, bfs, c->depth + 1);
+        if (pos >= limit)
+            break;
+
+        c->pos[++c->depth] = pos;
+        c->bfs = bfs;
+        node = &veb->elements[pos];
+    }
+
+    /* the answer is on the path, so its positions are already in pos */
+    c->bfs = best;
+    c->depth = best_depth;
+    return cursor_land(c, true);
+}
+
+static struct tree_node *cursor_end(struct veb *veb, struct veb_cursor *c,
+                                    bool last)
+{
+    cursor_start(veb, c);
+    if (c->bfs)
+        cursor_down(c, last, true);
+    return cursor_land(c, !last);
+}
+
+/*
+ *  In-order step.  The successor is the leftmost node of the right
+ *  subtree if there is one, else the first ancestor we are left of.
+ */
+static struct tree_node *cursor_step_once(struct veb_cursor *c, bool fwd)
+{
+    struct tree_node *node = cursor_node(c);
+
+    if (fwd ? node->right : node->left)
+    {
+        cursor_down(c, fwd, false);
+        cursor_down(c, !fwd, true);
+        return cursor_land(c, fwd);
+    }
+
+    while (c->bfs > 1 && bfs_is_right(c->bfs) == fwd)
+    {
+        c->bfs = bfs_parent(c->bfs);
+        c->depth--;
+    }
+    c->bfs = bfs_parent(c->bfs);
+    c->depth--;
+    return cursor_land(c, fwd);
+}
+
+/* the path is stale: find the neighbour of our key from the top */
+static struct tree_node *cursor_reseek(struct veb_cursor *c, bool fwd)
+{
+    packed_key_t key = c->key;
+    struct tree_node *node = cursor_seek(c->tree, &key, c);
+
+    if (node && compare_key(&node->key, &key) == 0)
+        return cursor_step_once(c, fwd);
+    if (fwd)
+        return node;
+    return node ? cursor_step_once(c, false) : cursor_end(c->tree, c, true);
+}
+
+enum cursor_move { SEEK, FIRST, LAST, NEXT, PREV };
+
+/*
+ *  While a grow is under way the keys are split between two trees.
+ *  Every move is then made in both and the nearer answer kept; a
+ *  step can't follow the path across trees, so it is always a seek
+ *  from the key.  Migrations are short, so this is rare.
+ */
+static struct tree_node *cursor_move_both(struct veb *veb,
+                                          struct veb_cursor *c,
+                                          enum cursor_move move,
+                                          packed_key_t *k)
+{
+    struct veb_cursor a = *c, b = *c;
+    struct tree_node *na, *nb;
+    bool smaller = move == SEEK || move == FIRST || move == NEXT;
+
+    switch (move)
+    {
+    case SEEK:
+        na = cursor_seek(veb, k, &a);
+        nb = cursor_seek(veb->old, k, &b);
+        break;
+    case FIRST:
+    case LAST:
+        na = cursor_end(veb, &a, move == LAST);
+        nb = cursor_end(veb->old, &b, move == LAST);
+        break;
+    default:
+        if (!c->bfs)
+            return NULL;
+        a.tree = veb;
+        b.tree = veb->old;
+        na = cursor_reseek(&a, move == NEXT);
+        nb = cursor_reseek(&b, move == NEXT);
+        break;
+    }
+
+    if (nb && (!na || (compare_key(&nb->key, &na->key) < 0) == smaller))
+    {
+        *c = b;
+        return nb;
+    }
+    *c = a;
+    return na;
+}
+
+static struct tree_node *cursor_move_one(struct veb *veb,
+                                         struct veb_cursor *c,
+                                         enum cursor_move move,
+                                         packed_key_t *k, u32 g)
+{
+    switch (move)
+    {
+    case SEEK:
+        return cursor_seek(veb, k, c);
+    case FIRST:
+    case LAST:
+        return cursor_end(veb, c, move == LAST);
+    default:
+        if (!c->bfs)
+            return NULL;
+        if (g != c->gen || c->tree != veb)
+        {
+            c->tree = veb;
+            return cursor_reseek(c, move == NEXT);
+        }
+        return cursor_step_once(c, move == NEXT);
+    }
+}
+
+static struct tree_node *cursor_move(struct veb *veb, struct veb_cursor *c,
+                                     enum cursor_move move, packed_key_t *k)
+{
+    struct tree_node *node;
+    struct veb *tree = c->tree;
+    u64 bfs = c->bfs;
+    int depth = c->depth;
+    u32 g;
+
+    c->veb = veb;
+    for (;;)
+    {
+        g = read_seq_begin(&veb->gen);
+
+        if (veb->migrating)
+            node = cursor_move_both(veb, c, move, k);
+        else
+            node = cursor_move_one(veb, c, move, k, g);
+        if (node)
+            c->key = node->key;
+
+        if (!read_seq_retry(&veb->gen, g))
+            break;
+
+        /* a moved path is found again from the key next time round */
+        c->tree = tree;
+        c->bfs = bfs;
+        c->depth = depth;
+    }
+    c->gen = g;
+    return node;
+}
+
+/*
+ *  Position c at the first key >= key and return its node, or NULL
+ *  if every key is smaller.  Scanning all items of an objectid is a
+ *  lower_bound on (objectid, 0, 0) followed by next() until the
+ *  objectid changes.  A key whose offset doesn't fit gives NULL with
+ *  errno EINVAL.
+ */
+struct tree_node *veb_tree_lower_bound(struct veb *veb, btrfs_key_t *key,
+                                       struct veb_cursor *c)
+{
+    packed_key_t k;
+
+    if (!key_fits(key))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    k = pack_key(key);
+    return cursor_move(veb, c, SEEK, &k);
+}
+
+struct tree_node *veb_tree_first(struct veb *veb, struct veb_cursor *c)
+{
+    return cursor_move(veb, c, FIRST, NULL);
+}
+
+struct tree_node *veb_tree_last(struct veb *veb, struct veb_cursor *c)
+{
+    return cursor_move(veb, c, LAST, NULL);
+}
+
+struct tree_node *veb_cursor_next(struct veb_cursor *c)
+{
+    return cursor_move(c->veb, c, NEXT, NULL);
+}
+
+struct tree_node *veb_cursor_prev(struct veb_cursor *c)
+{
+    return cursor_move(c->veb, c, PREV, NULL);
+}
+
+static struct veb *veb_alloc(int fd, const char *path, bool create)
+{
+    struct veb *veb = calloc(1, sizeof(*veb));
+
+    veb->allocs = 1;
+    veb->fd = fd;
+    veb->log = setup_log(veb, path, create);
+
+    veb->dirty = calloc(DIRTY_LONGS, sizeof(long));
+    veb->flushing = calloc(DIRTY_LONGS, sizeof(long));
+    veb->old = calloc(1, sizeof(*veb->old));
+    veb->allocs += 3;
+    pthread_mutex_init(&veb->map_lock, NULL);
+    pthread_cond_init(&veb->flush_wait, NULL);
+    return veb;
+}
+
+/*
+ * Create a new complete VEB layout tree capable of storing at
+ * least nitems in the leaves, replacing any file at path.  The
+ * height of the tree will be lg 2*nitems.  A nonzero block lays it
+ * out in aligned blocks of that height, VEB_PAGE_BLOCK to fill pages
+ * or VEB_HUGE_BLOCK huge pages; 0 is the plain vEB layout.  A leaf
+ * of 2 up to VEB_MAX_LEAF keeps the bottom subtrees of that height
+ * as sorted arrays.
+ */
+struct veb *veb_tree_create(const char *path, u64 nitems, int block,
+                            int leaf)
+{
+    int height = ilog2_64(2 * nitems) + 1;
+    struct veb *veb;
+    int fd;
+
+    if (block < 0 || block > VEB_HUGE_BLOCK ||
+        leaf < 0 || leaf > VEB_MAX_LEAF)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    veb = veb_alloc(fd, path, true);
+    veb->block_height = block;
+    veb->leaf_height = leaf;
+    veb->base = first_base(block);
+    map_file(veb, height);
+    veb->allocs++;
+
+    /* density range from 0.5 to 1 */
+    veb->min_density = 0x08000;
+    veb->max_density = 0x10000;
+    set_height(veb, height);
+    veb->count = 0;
+    publish_header(veb);
+
+    return veb;
+}
+
+/*
+ *  Build a tree at path from n keys in ascending order, in O(n).
+ *  The height is the lowest that keeps the root at or under fill, in
+ *  16.16 fixed point like the tree's densities.  0 picks the target
+ *  halfway between min_density and max_density, so that a built tree
+ *  comes out the size inserts would have grown it to; min_density
+ *  alone often gives one twice that.
+ *  One pass over the keys checks them and a second streams them into
+ *  the new tree, which goes in after an empty one, so a crash part way
+ *  leaves the empty tree.  Duplicates are dropped.  Returns NULL,
+ *  leaving an empty tree at path, if the keys are out of order or an
+ *  offset doesn't fit.
+ */
+struct veb *veb_tree_build_sorted(const char *path, btrfs_key_t *keys,
+                                  u64 n, int fill, int block, int leaf)
+{
+    struct veb *veb = veb_tree_create(path, 1, block, leaf);
+    struct stream s = { .keys = keys, .nrun = n };
+    packed_key_t key, last;
+    u64 count = 0;
+    int height;
+    u64 i;
+    int cmp;
+
+    if (!veb)
+        return NULL;
+
+    if (fill <= 0)
+        fill = (veb->min_density + veb->max_density) / 2;
+    fill = min(fill, veb->max_density);
+
+    for (i=0; i < n; i++)
+    {
+        key = pack_key(&keys[i]);
+        cmp = count ? compare_key(&key, &last) : 1;
+
+        if (cmp < 0 || !key_fits(&keys[i]))
+        {
+            veb_tree_free(veb);
+            errno = EINVAL;
+            return NULL;
+        }
+        count += cmp > 0;
+        last = key;
+    }
+
+    /* density() would overflow for a full-sized count in a small tree */
+    for (height = veb->height;
+         (count << 16) > (u64) fill * tree_size(height); height++)
+        ;
+    relocate(veb, height, count, &s);
+
+    return veb;
+}
+
+/*
+ *  Recompute the links and subtree counts from bfs up to the root
+ *  from the nodes below them.  Nothing else on the path can be
+ *  trusted after a crash, but everything off it can.
+ */
+static void repair_path(struct veb *veb, u64 bfs)
+{
+    u64 pos[MAX_HEIGHT];
+    int d = fill_pos(veb->level_info, bfs, pos);
+    int i;
+
+    for (; d >= 0; d--, bfs = bfs_parent(bfs))
+    {
+        struct tree_node *node = &veb->elements[pos[d]];
+
+        if (node_empty(node))
+            continue;
+
+        node->count = 1;
+        node->left = node->right = 0;
+        for (i=0; i < 2 && d + 1 < veb->height; i++)
+        {
+            struct tree_node *child =
+                node_at_pos(veb, 2 * bfs + i, pos, d + 1);
+
+            if (node_empty(child))
+                continue;
+
+            node->count += child->count;
+            if (i)
+                node->right = make_link(veb, pos, d + 1);
+            else
+                node->left = make_link(veb, pos, d + 1);
+        }
+        mark_dirty(veb, node);
+    }
+    veb->count = veb->elements[0].count;
+}
+
+/*
+ *  Redo whatever the intent says was in flight when the tree was
+ *  last closed.  Each case is idempotent, so a crash during recovery
+ *  is recovered the same way.
+ */
+static void recover(struct veb *veb)
+{
+    struct veb_intent *in = &veb->super->intent;
+    u64 pos[MAX_HEIGHT];
+    struct tree_node *node, *leaf;
+
+    switch (in->op)
+    {
+    case VEB_OP_NONE:
+        return;
+    case VEB_OP_INSERT:
+        assert(in->height == (u32) veb->height);
+        node = &veb->elements[pos[fill_pos(veb->level_info, in->bfs, pos)]];
+        if (node_empty(node))
+        {
+            node->key = in->key;
+            mark_dirty(veb, node);
+        }
+        repair_path(veb, in->bfs);
+        break;
+    case VEB_OP_REBALANCE:
+    case VEB_OP_PRUNE:
+        assert(in->height == (u32) veb->height);
+        rebuild_subtree(veb);
+        repair_path(veb, in->bfs);
+        break;
+    case VEB_OP_DELETE:
+        assert(in->height == (u32) veb->height);
+        node = &veb->elements[pos[fill_pos(veb->level_info, in->bfs, pos)]];
+        leaf = &veb->elements[pos[fill_pos(veb->level_info, in->slot, pos)]];
+        /* the key moves up first, then the leaf is emptied */
+        if (leaf != node && !compare_key(&node->key, &in->key))
+            node->key = leaf->key;
+        if (!node_empty(leaf) &&
+            !compare_key(&leaf->key, leaf != node ? &node->key : &in->key))
+        {
+            leaf->key.objectid = NULL_KEY;
+            leaf->count = 0;
+        }
+        mark_dirty(veb, node);
+        mark_dirty(veb, leaf);
+        repair_path(veb, in->slot);
+        break;
+    default:
+        die("bad intent in tree header");
+    }
+    publish_header(veb);
+    end_op(veb);
+}
+
+/*
+ *  Map an existing tree.  Only the header is checked, so the tree
+ *  is ready as soon as the mapping is; nodes fault in on first use.
+ *  If the last user crashed, its one unfinished operation is redone
+ *  from the intent and the log first.
+ */
+struct veb *veb_tree_open(const char *path)
+{
+    struct veb_super super;
+    struct veb_header *h = NULL;
+    struct stat st;
+    struct veb *veb;
+    int fd, i;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    if (pread(fd, &super, sizeof(super), 0) == sizeof(super) &&
+        fstat(fd, &st) == 0)
+    {
+        for (i=0; i < 2; i++)
+            if (header_valid(&super.hdr[i], st.st_size) &&
+                (!h || super.hdr[i].generation > h->generation))
+                h = &super.hdr[i];
+    }
+    if (!h)
+    {
+        fprintf(stderr, "%s: not a vEB tree file\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    veb = veb_alloc(fd, path, false);
+    veb->block_height = h->block_height;
+    veb->leaf_height = h->leaf_height;
+    veb->base = h->base;
+    map_file(veb, h->height);
+    veb->allocs++;
+
+    veb->min_density = h->min_density;
+    veb->max_density = h->max_density;
+    veb->generation = h->generation;
+    set_height(veb, h->height);
+
+    /*
+     *  The header count is only rewritten on close; the root's
+     *  subtree count is always current, so trust it instead.
+     */
+    veb->count = veb->elements[0].count;
+    if (h->old_height)
+    {
+        grow_setup(veb, h->old_base, h->old_height);
+        veb->migrated = h->migrated;
+        veb->moving = h->moving;
+        veb->old_count = old_count(veb);
+    }
+
+    recover(veb);
+    if (veb->migrating)
+    {
+        veb->count += veb->old_count;
+        grow_resume(veb);
+    }
+    return veb;
+}
+
+static u64 check_subtree(struct veb *veb, u64 bfs, u64 *pos, int d,
+                         packed_key_t *lo, packed_key_t *hi, bool *ok)
+{
+    struct tree_node *node = node_at_pos(veb, bfs, pos, d);
+    u64 count = 1;
+    u64 sub;
+
+    if (node_empty(node))
+        return 0;
+
+    if ((lo && compare_key(&node->key, lo) <= 0) ||
+        (hi && compare_key(&node->key, hi) >= 0))
+        *ok = false;
+
+    if (d + 1 < veb->height)
+    {
+        sub = check_subtree(veb, bfs_left(bfs), pos, d + 1, lo,
+                            &node->key, ok);
+        if (node->left != (sub ? make_link(veb, pos, d + 1) : 0))
+            *ok = false;
+        count += sub;
+
+        sub = check_subtree(veb, bfs_right(bfs), pos, d + 1, &node->key,
+                            hi, ok);
+        if (node->right != (sub ? make_link(veb, pos, d + 1) : 0))
+            *ok = false;
+        count += sub;
+    }
+    else if (node->left || node->right)
+        *ok = false;
+
+    if (node->count != count)
+        *ok = false;
+    return count;
+}
+
+/*
+ *  Walk the whole tree checking key order, links and subtree counts.
+ */
+bool veb_tree_check(struct veb *veb)
+{
+    u64 pos[MAX_HEIGHT];
+    bool ok = true;
+    u64 count, bfs;
+    packed_key_t *prev = NULL;
+
+    pos[0] = 0;
+    count = check_subtree(veb, 1, pos, 0, NULL, NULL, &ok);
+    if (!veb->migrating)
+        return count == veb->count && ok;
+
+    /*
+     *  Halfway through a grow only the order of the old keys holds;
+     *  its top is counted in the new tree.
+     */
+    for (bfs = bfs_first(veb->old, 1, pos); bfs;
+         bfs = bfs_next(veb->old, bfs, 1, pos))
+    {
+        struct tree_node *node = node_at_pos(veb->old, bfs, pos,
+                                             ilog2_64(bfs));
+
+        if (prev && compare_key(prev, &node->key) >= 0)
+            ok = false;
+        prev = &node->key;
+        count += ilog2_64(bfs) >= veb->chunk_depth;
+    }
+    return count == veb->count && ok;
+}
+
+/*
+ *  Write back every page dirtied since the last sync, including the
+ *  last header published.  Writeback is started for each run of dirty
+ *  pages, and a single fdatasync then waits for it and flushes the
+ *  device once; an msync per run would commit the journal once per
+ *  run.  Called with map_lock held.  Returns the number of pages
+ *  written, or -errno.
+ */
+static int sync_locked(struct veb *veb)
+{
+    unsigned long npages, start, end, i;
+    int written = 0;
+    int ret = 0;
+
+    npages = (veb->map_size + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+
+    /* pages written from here on go to the next sync */
+    for (i=0; i < (npages + BITS_PER_LONG - 1) / BITS_PER_LONG; i++)
+        veb->flushing[i] = __atomic_exchange_n(&veb->dirty[i], 0,
+                                               __ATOMIC_ACQUIRE);
+
+    for (start = find_next_bit(veb->flushing, npages, 0); start < npages;
+         start = find_next_bit(veb->flushing, npages, end))
+    {
+        end = find_next_zero_bit(veb->flushing, npages, start);
+
+        if (sync_file_range(veb->fd, (off_t) start << PAGE_SHIFT,
+                            (off_t) (end - start) << PAGE_SHIFT,
+                            SYNC_FILE_RANGE_WRITE) < 0)
+        {
+            perror("sync_file_range");
+            ret = -errno;
+        }
+        written += end - start;
+        bitmap_clear(veb->flushing, start, end - start);
+    }
+
+    if (written && fdatasync(veb->fd) < 0)
+    {
+        perror("fdatasync");
+        ret = -errno;
+    }
+    return ret ? ret : written;
+}
+
+/*
+ *  Publish the header and write back everything dirty.  Only the
+ *  writer may call this, as it is the one thread that knows no
+ *  operation is half done.
+ */
+int veb_tree_sync(struct veb *veb)
+{
+    int ret;
+
+    pthread_mutex_lock(&veb->map_lock);
+    write_header(veb);
+    ret = sync_locked(veb);
+    pthread_mutex_unlock(&veb->map_lock);
+    return ret;
+}
+
+static void *veb_flusher(void *arg)
+{
+    struct veb *veb = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&veb->map_lock);
+    while (veb->flush_ms)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += veb->flush_ms / 1000;
+        ts.tv_nsec += (veb->flush_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&veb->flush_wait, &veb->map_lock, &ts);
+        if (veb->flush_ms)
+            sync_locked(veb);
+    }
+    pthread_mutex_unlock(&veb->map_lock);
+    return NULL;
+}
+
+/*
+ *  Sync the tree every interval_ms from a background thread, so a
+ *  checkpoint costs in proportion to what changed since the last one.
+ *  Inserts do not wait for it except while the tree is growing.
+ */
+void veb_tree_start_flusher(struct veb *veb, int interval_ms)
+{
+    assert(interval_ms > 0 && !veb->flush_ms);
+
+    veb->flush_ms = interval_ms;
+    if (pthread_create(&veb->flusher, NULL, veb_flusher, veb))
+    {
+        perror("pthread_create");
+        veb->flush_ms = 0;
+    }
+}
+
+/*
+ *  Make every rebuild wait for its redo log and intent to be on disk
+ *  before it starts, so the tree survives a power cut, not just a
+ *  crashed process.  It costs two fdatasync()s per rebuild, so it is
+ *  off unless asked for, and not kept in the file.
+ */
+void veb_tree_set_durable(struct veb *veb, bool durable)
+{
+    veb->durable = durable;
+}
+
+static void stop_flusher(struct veb *veb)
+{
+    if (!veb->flush_ms)
+        return;
+
+    pthread_mutex_lock(&veb->map_lock);
+    veb->flush_ms = 0;
+    pthread_cond_signal(&veb->flush_wait);
+    pthread_mutex_unlock(&veb->map_lock);
+    pthread_join(veb->flusher, NULL);
+}
+
+/*
+ *  Write back the header and whatever is still dirty, and nothing else.
+ */
+void veb_tree_free(struct veb *veb)
+{
+    stop_flusher(veb);
+    veb_tree_sync(veb);
+    munmap(veb->super, REGION_SIZE);
+    close(veb->fd);
+
+    /* nothing is in flight, so the log can give its blocks back */
+    if (ftruncate(veb->log_fd, 0) < 0)
+        perror("ftruncate");
+    close(veb->log_fd);
+
+    pthread_mutex_destroy(&veb->map_lock);
+    pthread_cond_destroy(&veb->flush_wait);
+    free(veb->dirty);
+    free(veb->flushing);
+    free(veb->old);
+    free(veb->batch_buf);
+    munmap(veb->log, REGION_SIZE);
     free(veb);
 }
 
@@ -3,10 +3,21 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int64_t s64;
+
+#ifdef __cplusplus
+/* the lookups in veb_search.cc share the layout below */
+#define _Static_assert static_assert
+#define VEB_CONSTEXPR constexpr
+extern "C" {
+#else
+#define VEB_CONSTEXPR
+#endif
 
 #define MAX_HEIGHT 64
 
@@ -16,30 +27,354 @@ typedef struct {
     u64 offset;
 } btrfs_key_t;
 
+/*
+ *  The key as it is stored in a node: type is folded into the top
+ *  byte of the offset, so the whole key is two words and compares
+ *  as (objectid, type_offset).  Offsets must fit in 56 bits; the tree
+ *  calls refuse keys whose offsets don't with EINVAL, since packing
+ *  one would fold it onto another key.
+ */
+#define KEY_OFFSET_BITS 56
+#define KEY_OFFSET_MASK ((1ULL << KEY_OFFSET_BITS) - 1)
+
+typedef struct {
+    u64 objectid;
+    u64 type_offset;
+} packed_key_t;
+
+static inline bool key_fits(const btrfs_key_t *key)
+{
+    return key->offset <= KEY_OFFSET_MASK;
+}
+
+static inline packed_key_t pack_key(btrfs_key_t *key)
+{
+    packed_key_t packed;
+
+    packed.objectid = key->objectid;
+    packed.type_offset = ((u64)key->type << KEY_OFFSET_BITS) |
+        (key->offset & KEY_OFFSET_MASK);
+    return packed;
+}
+
+static inline void unpack_key(packed_key_t *packed, btrfs_key_t *key)
+{
+    key->objectid = packed->objectid;
+    key->type = packed->type_offset >> KEY_OFFSET_BITS;
+    key->offset = packed->type_offset & KEY_OFFSET_MASK;
+}
+
+/* an empty slot's objectid */
+#define NULL_KEY (0ULL)
+
+/*
+ *  A packed key read as one 128-bit number, objectid in the high
+ *  word: keys order the same way as those numbers do.
+ */
+static inline unsigned __int128 key_value(const packed_key_t *k)
+{
+    return (unsigned __int128) k->objectid << 64 | k->type_offset;
+}
+
+/*
+ *  Compare as 128-bit numbers, which is a subtract and a borrow with
+ *  the result picked by flags, so random keys cost no mispredicted
+ *  branches.  Lookups turn on cmp > 0 the same way.
+ */
+static inline int compare_key(const packed_key_t *k1, const packed_key_t *k2)
+{
+    unsigned __int128 a = key_value(k1);
+    unsigned __int128 b = key_value(k2);
+
+    return (a > b) - (a < b);
+}
+
+/*
+ *  Sequence counts for the lockless readers, as in the kernel's
+ *  seqcount: the writer makes a count odd while it rewrites what the
+ *  count covers, and a reader that saw it change starts over.
+ */
+static inline void write_seq_begin(u32 *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seq_end(u32 *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline u32 read_seq_begin(u32 *seq)
+{
+    u32 s;
+
+    while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+        __builtin_ia32_pause();
+    return s;
+}
+
+static inline bool read_seq_retry(u32 *seq, u32 s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
+
+/*
+ *  The shape of the layout.  veb_search.cc works its tables out from
+ *  these at compile time, so they are constexpr there.
+ */
+static inline VEB_CONSTEXPR u64 tree_size(int height)
+{
+    return (1ULL << height) - 1;
+}
+
+/*
+ *  Height of the top half of the vEB split: the bottom half is the
+ *  power of two no less than half the height.
+ */
+static inline VEB_CONSTEXPR int split_height(int height)
+{
+    int bottom = 1;
+
+    while (bottom < (height + 1) / 2)
+        bottom <<= 1;
+    return height > 1 ? height - bottom : 0;
+}
+
+/*
+ *  Children are linked by their distance forward in the element array,
+ *  which in vEB order is always positive; 0 means no child.  Being
+ *  relative, the links stay valid wherever the file is mapped.  Links
+ *  that cross from a top tree split off at the root into its bottom
+ *  subtrees can be too far for 32 bits, so those are just a flag: the
+ *  child is found from its bfs number instead.  So are those inside a
+ *  leaf block, where a left child comes before its parent.
+ *
+ *  A node is 32 bytes, so an aligned 128-byte line pair holds four.
+ *  The subtree count and the inline payload share the last word.  40
+ *  bits of count is enough for a tree of height 40, and the mapping
+ *  only has room for height 36.
+ */
+#define VEB_COUNT_BITS 40
+#define VEB_PAYLOAD_BITS 24
+
 struct tree_node {
-    btrfs_key_t key;
-    struct tree_node *left;
-    struct tree_node *right;
-    int payload;
+    packed_key_t key;
+    u32 left;
+    u32 right;
+    u64 count : VEB_COUNT_BITS;     /* occupied nodes in the subtree here */
+    u64 payload : VEB_PAYLOAD_BITS;
 };
 
+_Static_assert(sizeof(struct tree_node) == 32, "tree_node must be 32 bytes");
+
+/*
+ *  On-disk layout: one header page, then the node array.  The
+ *  checksum covers the header fields before it; the nodes are not
+ *  checksummed so that opening a tree never has to read them.
+ */
+#define VEB_MAGIC 0x0065657274626576ULL     /* "vebtree" */
+#define VEB_VERSION 8
+#define VEB_HEADER_SIZE 4096
+
+struct veb_header {
+    u64 magic;
+    u32 version;
+    u32 node_size;          /* sizeof(struct tree_node) when written */
+    u32 height;
+    u32 min_density;
+    u32 max_density;
+    u32 block_height;       /* of the layout's aligned blocks, or 0 */
+    u32 leaf_height;        /* of the sorted-array leaf blocks, or 0 */
+    u64 base;               /* node index the tree starts at */
+    u64 old_base;           /* the tree being grown out of, if any */
+    u32 old_height;         /* 0 when not growing */
+    u64 count;
+    u64 migrated;           /* old subtrees moved so far */
+    u64 moving;             /* bfs of the one being moved, or 0 */
+    u64 generation;         /* the newer valid copy wins */
+    u32 checksum;
+};
+
+enum veb_op {
+    VEB_OP_NONE,
+    VEB_OP_INSERT,          /* new node at bfs */
+    VEB_OP_REBALANCE,       /* subtree at bfs rebuilt, merging in the log */
+    VEB_OP_PRUNE,           /* subtree at bfs rebuilt without key */
+    VEB_OP_DELETE,          /* key at bfs replaced from slot, slot emptied */
+};
+
+/*
+ *  The operation in progress, so that open can redo it after a
+ *  crash.  op is stored last when an operation starts and cleared
+ *  when it is done; the keys a rebalance merges in are in the log.
+ *  A rebuild packs the subtree's keys to its left end, then streams
+ *  them back out, and records how far it got in each step here.
+ */
+struct veb_intent {
+    u32 op;
+    u32 height;             /* tree height after the operation */
+    u64 bfs;
+    u64 count;              /* keys in the log */
+    packed_key_t key;       /* the key being inserted or deleted */
+    u64 slot;               /* the leaf a delete empties */
+    u64 kept;               /* keys of the subtree left once packed */
+    s64 total;              /* and with the log's, or -1 until packed */
+    u64 placed;             /* keys streamed back out so far */
+};
+
+/*
+ *  The header page.  The header is written to the two slots in
+ *  turn, so a crash while writing one leaves the other intact.
+ */
+struct veb_super {
+    struct veb_header hdr[2];
+    struct veb_intent intent;
+};
+
+_Static_assert(sizeof(struct veb_super) <= VEB_HEADER_SIZE,
+               "header page overflow");
+
+/*
+ *  Bottom blocks that get their own sequence count.  In taller trees
+ *  blocks share them by the low bits of their index.
+ */
+#define VEB_BLOCK_BITS 12
+
+/*
+ *  How the node at depth d is found from its bottom subtree's root's
+ *  ancestor at subtree_depth: top_size is the mask of bfs bits that
+ *  picks the bottom subtree, top_span the slots before the first one
+ *  and bottom_size the slots from one to the next.
+ */
 struct level_info {
     int subtree_depth;
-    int top_size;
-    int bottom_size;
+    u64 top_size;
+    u64 top_span;
+    u64 bottom_size;
 };
 
+/*
+ *  Block heights for the blocked layout: the tree is cut into
+ *  subtrees this tall, each aligned and padded to fill exactly a page,
+ *  or a huge page, of nodes.
+ */
+#define VEB_PAGE_BLOCK 7
+#define VEB_HUGE_BLOCK 16
+
+/*
+ *  Leaf blocks: the bottom subtrees up to this tall can be kept as
+ *  gapped sorted arrays, which a lookup scans with a SIMD compare
+ *  per slot instead of walking down level by level.
+ */
+#define VEB_MAX_LEAF 6
+
+struct veb;
+
+/*
+ *  A lookup: the node holding key or NULL, with the bottom block's
+ *  sequence count it read under, if any, left in *bseq and *bs.
+ */
+typedef struct tree_node *(*veb_search_fn)(struct veb *veb,
+                                           packed_key_t *key,
+                                           u32 **bseq, u32 *bs);
+
 /* A tree in van Emde Boas layout.  All pointers are implicit. */
 struct veb {
     int height;
+    int block_height;       /* of the layout's blocks, 0 for plain vEB */
+    u64 span;               /* slots the tree takes in the file */
+    veb_search_fn search;   /* picked for the height and layout */
+    u64 far_links;          /* bit d: links to depth d are only flags */
+    int leaf_height;        /* of the leaf blocks asked for, 0 for none */
+    int leaf_depth;         /* of the leaf blocks' roots, height if none */
     int min_density;        /* min allowable density (16.16 fixed) */
     int max_density;        /* max allowable density */
-    int count;              /* # of nodes */
+    u64 count;              /* # of nodes */
+    int fd;                 /* backing file */
+    size_t map_size;        /* bytes of it mapped at super */
+    struct veb_super *super;
+    u64 base;               /* elements is node base after the header */
     struct tree_node *elements;
-    struct tree_node *scratch;
-    struct level_info *level_info;
+    u64 generation;         /* of the last header written, map_lock */
+
+    /*
+     *  The redo log: a shared mapping of <path>.log, so the keys a
+     *  rebalance merges in outlive a crashed process.  Rebuilds are
+     *  done in place, so that is all it ever holds.
+     */
+    int log_fd;
+    packed_key_t *log;
+    bool durable;           /* on disk before each rebuild starts */
+    struct level_info level_info[MAX_HEIGHT];
+    u64 allocs;             /* allocations made on behalf of the tree */
+    packed_key_t *batch_buf;    /* a batch's keys, then its plan */
+    u64 batch_cap;          /* keys batch_buf has room for */
+
+    /*
+     *  One bit per page of the file written since the last sync.
+     *  map_lock keeps the flusher off the mapping while it moves,
+     *  and off a header while it is written.
+     */
+    unsigned long *dirty;
+    unsigned long *flushing;    /* sync's snapshot of dirty */
+    pthread_mutex_t map_lock;
+    pthread_cond_t flush_wait;
+    pthread_t flusher;
+    int flush_ms;           /* flusher period, 0 if not running */
+
+    /*
+     *  Readers run without locks alongside a single writer.  A
+     *  rebalance makes the sequence count of the bottom vEB block it
+     *  rewrites odd until it is done, or seq when it reaches into the
+     *  top tree; readers that overlap retry, as do those in blocks
+     *  sharing the count.  Every reader waits on seq while the whole
+     *  tree is rebuilt by relocate(), and while a grow starts, takes
+     *  a moved chunk out of the old tree or ends.  gen moves with
+     *  every rebalance so cursors can tell their path went stale.
+     */
+    u32 seq;
+    u32 gen;
+    int top_height;         /* depth of the bottom block roots */
+    u32 block_seq[1 << VEB_BLOCK_BITS];
 
-    int iter_pos[MAX_HEIGHT];
+    /*
+     *  Growing is incremental.  The new tree is laid out after the
+     *  old one in the file with the old top copied, and the old
+     *  tree's keys move over one subtree at chunk_depth at a time,
+     *  a step for every update.  Until then old is a view of what is
+     *  left of the old tree, and lookups consult both.
+     */
+    struct veb *old;
+    bool migrating;
+    int chunk_depth;
+    u64 migrated;           /* chunks moved, in order */
+    u64 moving;             /* bfs of the chunk in flight, or 0 */
+    u64 old_count;          /* keys left below the old top */
+};
+
+/* the sequence count of the bottom block whose root is bfs, at top */
+static inline u32 *block_seq(struct veb *veb, int top, u64 bfs)
+{
+    return &veb->block_seq[(bfs - (1ULL << top)) &
+                           ((1 << VEB_BLOCK_BITS) - 1)];
+}
+
+/*
+ *  A position in an in-order walk of the tree.  It keeps its own
+ *  path from the root, so any number of cursors can be open on a
+ *  tree at once, and may be moved while the writer is inserting:
+ *  if a rebalance has moved its path, it finds key again first.
+ */
+struct veb_cursor {
+    struct veb *veb;
+    struct veb *tree;       /* veb, or veb->old while growing */
+    u64 bfs;                /* current node, 0 once off either end */
+    int depth;
+    u64 pos[MAX_HEIGHT];    /* element index of each node on the path */
+    packed_key_t key;       /* copy of the current key */
+    u32 gen;                /* veb->gen the path was found under */
 };
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
@@ -48,10 +383,31 @@ struct veb {
 
 /* Function prototypes */
 int veb_tree_insert(struct veb *veb, btrfs_key_t *search_key);
+u64 veb_tree_insert_batch(struct veb *veb, btrfs_key_t *keys, u64 n);
+int veb_tree_delete(struct veb *veb, btrfs_key_t *search_key);
 struct tree_node *veb_tree_search(struct veb *veb, btrfs_key_t *search_key);
-struct veb *veb_tree_new(int nitems, bool clear);
+bool veb_tree_lookup(struct veb *veb, btrfs_key_t *search_key,
+                     btrfs_key_t *out);
+struct tree_node *veb_tree_lower_bound(struct veb *veb, btrfs_key_t *key,
+                                       struct veb_cursor *c);
+struct tree_node *veb_tree_first(struct veb *veb, struct veb_cursor *c);
+struct tree_node *veb_tree_last(struct veb *veb, struct veb_cursor *c);
+struct tree_node *veb_cursor_next(struct veb_cursor *c);
+struct tree_node *veb_cursor_prev(struct veb_cursor *c);
+struct veb *veb_tree_create(const char *path, u64 nitems, int block,
+                            int leaf);
+struct veb *veb_tree_open(const char *path);
+struct veb *veb_tree_build_sorted(const char *path, btrfs_key_t *keys,
+                                  u64 n, int fill, int block, int leaf);
+bool veb_tree_check(struct veb *veb);
 void veb_tree_free(struct veb *veb);
+int veb_tree_sync(struct veb *veb);
+void veb_tree_start_flusher(struct veb *veb, int interval_ms);
+void veb_tree_set_durable(struct veb *veb, bool durable);
 void veb_tree_print(struct veb *veb);
-void pointerize(struct veb *veb);
 void die(char *s);
+
+#ifdef __cplusplus
+}
+#endif
 #endif
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include "types.h"
 #include "bitlib.h"
 
@@ -10,22 +12,22 @@
  *
  *  BFS number is in the range of 1..#nodes.
  */
-int bfs_to_veb(int bfs_number, int height)
+u64 bfs_to_veb(u64 bfs_number, int height)
 {
     int split;
     int top_height, bottom_height;
     int depth;
-    int subtree_depth, subtree_root, num_subtrees;
-    int toptree_size, subtree_size;
-    unsigned int mask;
-    int prior_length;
+    int subtree_depth;
+    u64 subtree_root, num_subtrees;
+    u64 toptree_size, subtree_size;
+    u64 prior_length;
 
     /* if this is a size-3 tree, bfs number is sufficient */
     if (height <= 2)
         return bfs_number;
 
     /* depth is level of the specific node */
-    depth = ilog2(bfs_number);
+    depth = ilog2_64(bfs_number);
 
     /* the vEB layout recursively splits the tree in half */
     split = hyperceil((height + 1) / 2);
@@ -52,11 +54,11 @@ int bfs_to_veb(int bfs_number, int height)
      */
 
     /* mask off common bits */
-    num_subtrees = 1 << top_height;
-    bfs_number &= (1 << subtree_depth) - 1;
+    num_subtrees = 1ULL << top_height;
+    bfs_number &= (1ULL << subtree_depth) - 1;
 
     /* replace it with one */
-    bfs_number |= 1 << subtree_depth;
+    bfs_number |= 1ULL << subtree_depth;
 
     /*
      * Now we need to count all the nodes before this one, then the
@@ -64,8 +66,8 @@ int bfs_to_veb(int bfs_number, int height)
      * this subtree root in the layout is the bottom k-1 bits of the
      * subtree root.
      */
-    subtree_size = (1 << bottom_height) - 1;
-    toptree_size = (1 << top_height) - 1;
+    subtree_size = (1ULL << bottom_height) - 1;
+    toptree_size = (1ULL << top_height) - 1;
 
     prior_length = toptree_size +
         (subtree_root & (num_subtrees - 1)) * subtree_size;
@@ -73,25 +75,25 @@ int bfs_to_veb(int bfs_number, int height)
     return prior_length + bfs_to_veb(bfs_number, bottom_height);
 }
 
-static inline struct tree_node *node_at(struct veb *veb, int bfs)
+static inline struct tree_node *node_at(struct veb *veb, u64 bfs)
 {
     return &veb->elements[bfs_to_veb(bfs, veb->height) - 1];
 }
 
-static inline int bfs_left(int bfs_num)
+static inline u64 bfs_left(u64 bfs_num)
 {
     return 2 * bfs_num;
 }
 
-static inline int bfs_right(int bfs_num)
+static inline u64 bfs_right(u64 bfs_num)
 {
     return 2 * bfs_num + 1;
 }
 
 void veb_tree_print(struct veb *veb)
 {
-    int i;
-    for (i=0; i < (1 << veb->height) - 1; i++)
+    u64 i;
+    for (i=0; i < (1ULL << veb->height) - 1; i++)
     {
         if (is_power_of_two(i+1))
             printf("\n");
@@ -102,43 +104,31 @@ void veb_tree_print(struct veb *veb)
 }
 
 
-void veb_tree_set_node_key(struct veb *veb, int bfs_index, key_t key)
+void veb_tree_set_node_key(struct veb *veb, u64 bfs_index, key_t key)
 {
     node_at(veb,bfs_index)->key = key;
+    node_at(veb,bfs_index)->min_key = key;
 }
 
-void veb_tree_link_leaf(struct veb *veb, int bfs_index, struct leaf *leaf)
+void veb_tree_link_leaf(struct veb *veb, u64 bfs_index, struct leaf *leaf)
 {
     node_at(veb,bfs_index)->leaf = leaf;
 }
 
 /*
- *  Update this node so that it contains the maximum of the
- *  left subtree and the left-most node of the right subtree.
- *  This ensures that every node to the right is at least greater
- *  than or equal to this node.
+ *  Update this node from its children.  min_key is the smallest key
+ *  below the node, and key is the smallest key in the right subtree,
+ *  so everything at or above key is to the right.  An empty right
+ *  subtree gets INT_MAX so that nothing is routed into it.
  */
-void veb_tree_recompute_index(struct veb *veb, int bfs_index)
+void veb_tree_recompute_index(struct veb *veb, u64 bfs_index)
 {
-    int i, nexti;
-    int lefti = bfs_left(bfs_index);
-    int righti = bfs_right(bfs_index);
-
-    struct tree_node *left = node_at(veb, lefti);
-    struct tree_node *right = node_at(veb, righti);
+    struct tree_node *node = node_at(veb, bfs_index);
+    struct tree_node *left = node_at(veb, bfs_left(bfs_index));
+    struct tree_node *right = node_at(veb, bfs_right(bfs_index));
 
-    int leftval = left->key;
-    int rightval = right->key;
-
-    /* explore to the left of right */
-    nexti = bfs_left(righti);
-    for (i=ilog2(righti) + 1; i < veb->height; i++)
-    {
-        struct tree_node *next = node_at(veb, nexti);
-        nexti = bfs_left(nexti);
-        rightval = next->key;
-    }
-    node_at(veb, bfs_index)->key = max(leftval, rightval);
+    node->min_key = left->min_key ? left->min_key : right->min_key;
+    node->key = right->min_key ? right->min_key : INT_MAX;
 }
 
 /*
@@ -151,12 +141,12 @@ void veb_tree_insert(struct veb *veb, key_t search_key)
     int cmp;
     struct tree_node *root = veb->elements;
     struct tree_node *node = root;
-    int bfs_num = 1;
+    u64 bfs_num = 1;
 
     for (i=0; i < veb->height; i++)
     {
-        int lefti = 2 * bfs_num - 1;
-        int righti = 2 * bfs_num;
+        u64 lefti = 2 * bfs_num - 1;
+        u64 righti = 2 * bfs_num;
         struct tree_node *left = &root[bfs_to_veb(lefti, veb->height)];
         struct tree_node *right = &root[bfs_to_veb(righti, veb->height)];
 
@@ -189,12 +179,12 @@ struct tree_node *veb_tree_find(struct veb *veb, key_t search_key)
     int cmp;
     struct tree_node *root = veb->elements;
     struct tree_node *node = root;
-    int bfs_num = 1;
+    u64 bfs_num = 1;
 
     for (i=1; i < veb->height; i++)
     {
-        int lefti = bfs_left(bfs_num);
-        int righti = bfs_right(bfs_num);
+        u64 lefti = bfs_left(bfs_num);
+        u64 righti = bfs_right(bfs_num);
         struct tree_node *left = node_at(veb, lefti);
         struct tree_node *right = node_at(veb, righti);
 
@@ -212,29 +202,73 @@ struct tree_node *veb_tree_find(struct veb *veb, key_t search_key)
     return node;
 }
 
+/*
+ *  As veb_tree_find, but return the number of the leaf (counting
+ *  from zero on the left) instead of the node.
+ */
+u64 veb_tree_find_segment(struct veb *veb, key_t search_key)
+{
+    int i;
+    u64 bfs_num = 1;
+
+    for (i=1; i < veb->height; i++)
+    {
+        if (search_key < node_at(veb, bfs_num)->key)
+            bfs_num = bfs_left(bfs_num);
+        else
+            bfs_num = bfs_right(bfs_num);
+    }
+    return bfs_num - (1ULL << (veb->height - 1));
+}
+
+/* bytes mapped for the nodes of a tree of the given height */
+static size_t veb_tree_bytes(int height)
+{
+    return ((1ULL << height) - 1) * sizeof(struct tree_node);
+}
+
 /*
  * Create a new complete VEB layout tree capable of storing at
  * least nitems in the leaves.  The height of the tree will be
  * lg 2*nitems.
  */
-struct veb *veb_tree_new(int nitems)
+struct veb *veb_tree_new(u64 nitems)
 {
-    int nodes = 2 * nitems - 1;
-    int height = ilog2(nodes) + 1;
+    u64 nodes = 2 * nitems - 1;
+    int height = ilog2_64(nodes) + 1;
 
     struct veb *veb = malloc(sizeof(*veb));
-    struct tree_node *elements = malloc(sizeof(*elements) * nodes);
 
-    memset(elements, 0, sizeof(*elements) * nodes);
+    /*
+     * Straight from mmap, so that a large index is zeroed lazily by
+     * the kernel; calloc() may clear recycled heap up front.
+     */
+    void *elements = mmap(NULL, veb_tree_bytes(height),
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-    veb->elements = elements;
+    veb->elements = elements == MAP_FAILED ? NULL : elements;
     veb->height = height;
     return veb;
 }
 
+/*
+ *  Free the tree but keep its nodes, which the caller now owns as an
+ *  anonymous mapping of *bytes to munmap() when it likes.
+ */
+void *veb_tree_detach(struct veb *veb, size_t *bytes)
+{
+    void *elements = veb->elements;
+
+    *bytes = veb_tree_bytes(veb->height);
+    free(veb);
+    return elements;
+}
+
 void veb_tree_free(struct veb *veb)
 {
-    free(veb->elements);
+    if (veb->elements)
+        munmap(veb->elements, veb_tree_bytes(veb->height));
     free(veb);
 }
 
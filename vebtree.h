@@ -5,11 +5,13 @@
 
 void veb_tree_insert(struct veb *veb, key_t search_key);
 struct tree_node *veb_tree_find(struct veb *veb, key_t search_key);
-struct veb *veb_tree_new(int nitems);
+u64 veb_tree_find_segment(struct veb *veb, key_t search_key);
+struct veb *veb_tree_new(u64 nitems);
 void veb_tree_free(struct veb *veb);
+void *veb_tree_detach(struct veb *veb, size_t *bytes);
 void veb_tree_print(struct veb *veb);
 
-void veb_tree_set_node_key(struct veb *veb, int bfs_index, key_t key);
-void veb_tree_recompute_index(struct veb *veb, int bfs_index);
-void veb_tree_link_leaf(struct veb *veb, int bfs_index, struct leaf *leaf);
+void veb_tree_set_node_key(struct veb *veb, u64 bfs_index, key_t key);
+void veb_tree_recompute_index(struct veb *veb, u64 bfs_index);
+void veb_tree_link_leaf(struct veb *veb, u64 bfs_index, struct leaf *leaf);
 #endif